@@ -1,4 +1,11 @@
 SendTrigN : UGen {
+	// maxRate: triggers per second and unit (0: no limit)
+	// shared: send the triggers of all units in one bundle per control period
+	// timestamps: wrap every /tr in a bundle with the time of its trigger
+	*configure { arg server, maxRate = 0, shared = false, timestamps = false;
+		server = server ? Server.default;
+		server.sendMsg('/cmd', 'sendTrigN', maxRate, shared.binaryValue, timestamps.binaryValue);
+	}
 	*ar { arg in = 0.0, id = 0 ... values;
 		this.multiNew('audio', in, id, *values);
 		^0.0		// SendTrig has no output
@@ -17,11 +17,18 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
 // USA
 
+// batch: instances with the same batch id (> 0) and configuration share
+// one kernel, and the partitions they compute in the RT thread are
+// computed together once per block. numRTProcs, maxRTLoad and
+// overloadPolicy apply to each instance as without a batch; partitions
+// handed to the worker thread are not batched. tailCutoff is ignored in
+// batches.
+
 VEPConvolution : MultiOutUGen
 {
-	*ar { | inRef, kernel, kernelMaxSize(0), kernelOffset(0), kernelSize(0), kernelTrigger(0), minPartSize(0), maxPartSize(8192), numRTProcs(0) |
+	*ar { | inRef, kernel, kernelMaxSize(0), kernelOffset(0), kernelSize(0), kernelTrigger(0), minPartSize(0), maxPartSize(8192), numRTProcs(0), maxRTLoad(0.5), overloadPolicy(0), kernelFormat(0), batch(0), tailCutoff(0) |
 		var in = inRef.dereference;
-		^this.multiNewList(['audio', in.size] ++ in ++ [kernel, kernelMaxSize, kernelOffset, kernelSize, kernelTrigger, minPartSize, maxPartSize, numRTProcs])
+		^this.multiNewList(['audio', in.size] ++ in ++ [kernel, kernelMaxSize, kernelOffset, kernelSize, kernelTrigger, minPartSize, maxPartSize, numRTProcs, maxRTLoad, overloadPolicy, kernelFormat, batch, tailCutoff])
 	}
 	init { | argNumChannels ... theInputs |
 		inputs = theInputs;
@@ -22,6 +22,27 @@
 
 #include "SKUG.h"
 
+#include "VEP/VEPDSP.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#if defined(__SSE__)
+# include <xmmintrin.h>
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#if SKUG_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif // SKUG_THREADS
+#if SKUG_FFTW
+# include "VEP/VEPFFT.h"
+#endif // SKUG_FFTW
+
 using namespace SKUG;
 static InterfaceTable *ft;
 
@@ -30,50 +51,1656 @@ extern "C"
     void load(InterfaceTable *inTable);
 };
 
-inline int normalize_rot(int rot, int n)
+// Return the NRT buffer for bufnum, 0 if it's out of range (World_GetNRTBuf
+// silently maps those to buffer 0).
+static SndBuf* getNRTBuf(World* world, int bufnum)
+{
+    if ((bufnum < 0) || (bufnum >= (int)world->mNumSndBufs))
+        return 0;
+    return World_GetNRTBuf(world, bufnum);
+}
+
+/** Run independent tasks of a buffer generator on worker threads.
+
+    Tasks are handed out through an atomic counter to up to one thread
+    per processor but one, which is left to the audio thread. The
+    calling thread is worker 0 and the others are joined before run()
+    returns, so the NRT thread is blocked only for the parallel run
+    time. 'fn' gets the worker index for scratch memory, which the
+    caller sets up for numWorkers() workers; FFTW's allocator isn't
+    thread-safe. Without thread support the tasks run in order. */
+class Workers
+{
+public:
+    typedef void (*TaskFunc)(void* arg, size_t task, size_t worker);
+
+    // smaller jobs aren't worth starting threads
+    enum { kMinSamplesPerWorker = 65536 };
+
+    // number of workers for 'numTasks' tasks processing 'numSamples'
+    // samples in total
+    static size_t numWorkers(size_t numTasks, size_t numSamples)
+    {
+#if SKUG_THREADS
+        const long numProcs = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t n = (size_t)std::max(1L, numProcs - 1);
+        n = std::min(n, numSamples / kMinSamplesPerWorker);
+        return std::max((size_t)1, std::min(n, numTasks));
+#else
+        return 1;
+#endif // SKUG_THREADS
+    }
+
+    static void run(size_t numWorkers, size_t numTasks, TaskFunc fn, void* arg)
+    {
+        Job job = { fn, arg, numTasks, 0 };
+        std::vector<Worker> workers(std::max((size_t)1, numWorkers));
+        for (size_t i=0; i < workers.size(); ++i) {
+            workers[i].job = &job;
+            workers[i].index = i;
+        }
+#if SKUG_THREADS
+        std::vector<pthread_t> threads;
+        for (size_t i=1; i < workers.size(); ++i) {
+            pthread_t thread;
+            // the remaining tasks are run by the other workers
+            if (pthread_create(&thread, 0, threadFunc, &workers[i]) != 0) break;
+            threads.push_back(thread);
+        }
+        threadFunc(&workers[0]);
+        for (size_t i=0; i < threads.size(); ++i) {
+            pthread_join(threads[i], 0);
+        }
+#else
+        for (size_t i=0; i < numTasks; ++i) {
+            (*fn)(arg, i, 0);
+        }
+#endif // SKUG_THREADS
+    }
+
+private:
+    struct Job
+    {
+        TaskFunc    fn;
+        void*       arg;
+        size_t      numTasks;
+        size_t      nextTask;
+    };
+    struct Worker
+    {
+        Job*        job;
+        size_t      index;
+    };
+
+#if SKUG_THREADS
+    static void* threadFunc(void* arg)
+    {
+        Worker* w = (Worker*)arg;
+        Job* job = w->job;
+        size_t i;
+        while ((i = __sync_fetch_and_add(&job->nextTask, 1)) < job->numTasks) {
+            (*job->fn)(job->arg, i, w->index);
+        }
+        return 0;
+    }
+#endif // SKUG_THREADS
+};
+
+/** Reverse 'n' samples in place.
+
+    Swaps vectors of four samples from both ends, so the two streams
+    are read and written sequentially. */
+inline void reverse(float* data, size_t n)
 {
-    while (rot > n) rot -= n;
-    while (rot < -n) rot += n;
-    return rot;
+    float* a = data;
+    float* b = data + n;
+#if defined(__SSE__)
+    while (b - a >= 8) {
+        b -= 4;
+        const __m128 x = _mm_loadu_ps(a);
+        const __m128 y = _mm_loadu_ps(b);
+        _mm_storeu_ps(a, _mm_shuffle_ps(y, y, _MM_SHUFFLE(0, 1, 2, 3)));
+        _mm_storeu_ps(b, _mm_shuffle_ps(x, x, _MM_SHUFFLE(0, 1, 2, 3)));
+        a += 4;
+    }
+#endif
+    while (b - a > 1) {
+        const float x = *a;
+        *a++ = *--b;
+        *b = x;
+    }
+}
+
+/** Delay interleaved frames by 'frac' (0 <= frac < 1) frames with linear
+    interpolation, wrapping around at the buffer boundary.
+
+    Runs backwards, so every frame is interpolated with its unmodified
+    predecessor; the last frame is saved for the first one. */
+inline void fractional_delay(float* data, size_t frames, size_t channels, float frac)
+{
+    const size_t kChannelBlock = 16;
+    float last[kChannelBlock];
+
+    for (size_t c0=0; c0 < channels; c0 += kChannelBlock) {
+        const size_t n = std::min(kChannelBlock, channels - c0);
+        memCopy(last, data + (frames-1)*channels + c0, n);
+        for (size_t i=frames-1; i > 0; --i) {
+            float* y = data + i*channels + c0;
+            const float* x = y - channels;
+            for (size_t c=0; c < n; ++c) {
+                y[c] += frac * (x[c] - y[c]);
+            }
+        }
+        float* y = data + c0;
+        for (size_t c=0; c < n; ++c) {
+            y[c] += frac * (last[c] - y[c]);
+        }
+    }
+}
+
+/** Split a rotation by 'shift' frames into a right rotation by 'irot'
+    whole frames in [0, frames) and a fractional delay 'frac'. */
+inline void split_rotation(double shift, size_t frames, size_t& irot, float& frac)
+{
+    double rot = fmod(shift, (double)frames);
+    if (rot < 0.) rot += frames;
+    irot = (size_t)rot;
+    frac = (float)(rot - irot);
+    if (irot >= frames) irot -= frames;
 }
 
-/** Rotate the samples in a buffer by 'n'.
+/** Rotate the frames in a buffer by 'n'.
     
-    Negative shifts rotate to the left. */
+    Negative shifts rotate to the left. Fractional shifts interpolate
+    linearly between adjacent frames. The buffer is rotated in place by
+    three reversals of the interleaved samples, which keeps the order
+    of the channels within a frame. */
 void b_gen_rotate(World* world, SndBuf* buf, sc_msg_iter* msg)
 {
-    const int frames   = buf->frames;
-    const int channels = buf->channels;
-    const int rot      = normalize_rot((int)msg->getf(0), frames);
-    const int arot     = std::abs(rot);
-    const int remain   = frames - arot;
-    
-    // printf("rotate: %f %d\n", rot0, rot);
-    
-    if (arot > frames/2) {
-        float* tmp = rtAlloc<float>(ft, world, remain*channels);
-        if (rot > 0) {
-            memCopy(tmp                         , buf->data                   , remain*channels);
-            memMove(buf->data                   , buf->data + remain*channels , arot*channels  );
-            memCopy(buf->data + arot*channels   , tmp                         , remain*channels);
-        } else if (rot < 0) {
-            memCopy(tmp                         , buf->data + arot * channels , remain*channels);
-            memMove(buf->data + remain*channels , buf->data                   , arot*channels  );
-            memCopy(buf->data                   , tmp                         , remain*channels);
-        }
-        rtFree(ft, world, tmp);
-    } else if (rot < 0) {
-        float* tmp = rtAlloc<float>(ft, world, arot*channels);
-        if (rot > 0) {
-            memCopy(tmp                         , buf->data + remain*channels , arot*channels  );
-            memMove(buf->data + arot*channels   , buf->data                   , remain*channels);
-            memCopy(buf->data                   , tmp                         , arot*channels  );
-        } else if (rot < 0) {
-            memCopy(tmp                         , buf->data                 , arot*channels  );
-            memMove(buf->data                   , buf->data + arot*channels , remain*channels);
-            memCopy(buf->data + remain*channels , tmp                       , arot*channels  );
-        }
-        rtFree(ft, world, tmp);
+    const size_t frames   = buf->frames;
+    const size_t channels = buf->channels;
+
+    if ((buf->data == 0) || (frames == 0))
+        return;
+
+    size_t irot;
+    float frac;
+    split_rotation(msg->getf(0), frames, irot, frac);
+
+    if (irot > 0) {
+        const size_t n = frames*channels;
+        const size_t k = irot*channels;
+        reverse(buf->data    , n    );
+        reverse(buf->data    , k    );
+        reverse(buf->data + k, n - k);
+    }
+    if (frac > 0.f) {
+        fractional_delay(buf->data, frames, channels, frac);
+    }
+}
+
+#if SKUG_FFTW
+/** Uniformly partitioned FFT convolution of interleaved buffers.
+
+    The shorter signal is split into partitions of the FFT size and
+    convolved with consecutive blocks of the longer one through a
+    frequency domain delay line. Output channels are independent and
+    are distributed over the workers. */
+class FFTConvolver
+{
+public:
+    // partition size range; large partitions keep the number of
+    // spectral multiply-adds low for long signals
+    enum { kMinPartSize = 4096, kMaxPartSize = 32768 };
+
+    struct Signal
+    {
+        const float*    data;
+        size_t          channels;
+        size_t          frames;
+    };
+
+    FFTConvolver(float* dst, size_t channels, size_t frames, const Signal& x, const Signal& h)
+        : m_dst(dst), m_channels(channels), m_frames(frames),
+          m_x(x), m_h(h), m_workers(0)
+    {
+        // FFT plans are created here, not in the workers
+        m_fft = VEP::FFT::get(VEP::FFT::nextValidSize(std::min(std::max(m_h.frames, (size_t)kMinPartSize), (size_t)kMaxPartSize)), false);
+        m_numParts = (m_h.frames + partSize() - 1) / partSize();
+    }
+
+    size_t partSize() const { return m_fft->size(); }
+
+    void run()
+    {
+        const size_t numWorkers = Workers::numWorkers(m_channels, m_channels * m_frames);
+        std::vector<Worker> workers(numWorkers);
+        for (size_t i=0; i < numWorkers; ++i) {
+            workers[i].init(this);
+        }
+        m_workers = &workers[0];
+        Workers::run(numWorkers, m_channels, convolveTask, this);
+        m_workers = 0;
+        for (size_t i=0; i < numWorkers; ++i) {
+            workers[i].free();
+        }
+    }
+
+private:
+    // per thread scratch memory
+    struct Worker
+    {
+        void init(FFTConvolver* conv_)
+        {
+            conv = conv_;
+            const size_t N = conv->m_fft->paddedSize();
+            fftbuf = VEP::memAlloc<float>(N);
+            acc = VEP::memAlloc<float>(N);
+            overlap = VEP::memAlloc<float>(N/2);
+            spec = VEP::memAlloc<float>(conv->m_numParts * N);
+            fdl = VEP::memAlloc<float>(conv->m_numParts * N);
+        }
+        void free()
+        {
+            VEP::memFree(fdl);
+            VEP::memFree(spec);
+            VEP::memFree(overlap);
+            VEP::memFree(acc);
+            VEP::memFree(fftbuf);
+        }
+        FFTConvolver*   conv;
+        float*          fftbuf;
+        float*          acc;
+        float*          overlap;
+        float*          spec;       // partition spectra of h
+        float*          fdl;        // spectra of past blocks of x
+    };
+
+    static void convolveTask(void* arg, size_t c, size_t worker)
+    {
+        FFTConvolver* conv = (FFTConvolver*)arg;
+        conv->convolve(c, conv->m_workers[worker]);
+    }
+
+    // transform frames [begin, begin+P) of channel c of a signal
+    void transform(float* dst, float* fftbuf, const Signal& src, size_t c, size_t begin, float gain)
+    {
+        const size_t P = partSize();
+        const size_t N = m_fft->paddedSize();
+        const size_t n = begin < src.frames ? std::min(P, src.frames - begin) : 0;
+        const float* in = src.data + begin*src.channels + c;
+        for (size_t i=0; i < n; ++i) {
+            fftbuf[i] = gain * in[i*src.channels];
+        }
+        std::fill(fftbuf + n, fftbuf + N, 0.f);
+        m_fft->execute_forward_hc(fftbuf);
+        VEP::FFT::shufflehc(dst, fftbuf, N);
+    }
+
+    void convolve(size_t c, Worker& w)
+    {
+        float* fftbuf = w.fftbuf;
+        float* acc = w.acc;
+        float* overlap = w.overlap;
+        float* spec = w.spec;
+        float* fdl = w.fdl;
+        const size_t P = partSize();
+        const size_t N = m_fft->paddedSize();
+        const size_t xc = c % m_x.channels;
+        const size_t hc = c % m_h.channels;
+
+        for (size_t i=0; i < m_numParts; ++i) {
+            transform(spec + i*N, fftbuf, m_h, hc, i*P, (float)m_fft->norm());
+        }
+        std::fill(overlap, overlap + P, 0.f);
+
+        for (size_t j=0; j*P < m_frames; ++j) {
+            transform(fdl + (j % m_numParts)*N, fftbuf, m_x, xc, j*P, 1.f);
+            std::fill(acc, acc + N, 0.f);
+            for (size_t i=0; i <= std::min(j, m_numParts-1); ++i) {
+                VEP::DSP::cmac_hc(acc, fdl + ((j-i) % m_numParts)*N, spec + i*N, N);
+            }
+            VEP::FFT::unshufflehc(fftbuf, acc, N);
+            m_fft->execute_backward_hc(fftbuf);
+            const size_t n = std::min(P, m_frames - j*P);
+            float* out = m_dst + j*P*m_channels + c;
+            for (size_t i=0; i < n; ++i) {
+                out[i*m_channels] = fftbuf[i] + overlap[i];
+            }
+            memCopy(overlap, fftbuf + P, P);
+        }
+    }
+
+private:
+    float*          m_dst;
+    size_t          m_channels;
+    size_t          m_frames;
+    Signal          m_x;
+    Signal          m_h;
+    VEP::FFT*       m_fft;
+    size_t          m_numParts;
+    Worker*         m_workers;
+};
+
+/** Convolve two buffers into this one.
+
+    Arguments: bufnum of the first and the second source. Source
+    channels are repeated if the buffer has more channels; the result
+    is truncated to the buffer length. The sources may include the
+    buffer itself. */
+void b_gen_fftconv(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    SndBuf* a = getNRTBuf(world, msg->geti(-1));
+    SndBuf* b = getNRTBuf(world, msg->geti(-1));
+
+    if ((buf->data == 0) || (a == 0) || (b == 0)
+        || (a->data == 0) || (b->data == 0) || (a->frames == 0) || (b->frames == 0)) {
+        Print("fftconv: invalid buffer\n");
+        return;
+    }
+
+    FFTConvolver::Signal x = { a->data, (size_t)a->channels, (size_t)a->frames };
+    FFTConvolver::Signal h = { b->data, (size_t)b->channels, (size_t)b->frames };
+    if (x.frames < h.frames) std::swap(x, h);
+
+    const size_t frames = std::min((size_t)buf->frames, x.frames + h.frames - 1);
+
+    // copy sources that are overwritten
+    std::vector<float> xcopy, hcopy;
+    if (x.data == buf->data) {
+        xcopy.assign(x.data, x.data + x.frames*x.channels);
+        x.data = &xcopy[0];
+    }
+    if (h.data == buf->data) {
+        hcopy.assign(h.data, h.data + h.frames*h.channels);
+        h.data = &hcopy[0];
+    }
+
+    FFTConvolver conv(buf->data, buf->channels, frames, x, h);
+    conv.run();
+
+    std::fill(buf->data + frames*buf->channels, buf->data + buf->samples, 0.f);
+}
+
+/** Replace the phase of the signal in the first 'frames' samples of 'x'
+    by the minimum phase derived from the folded real cepstrum.
+
+    'x' holds fft->paddedSize() samples; magnitudes are floored at
+    'minMagnitude' relative to the peak. */
+void minimum_phase(VEP::FFT* fft, float* x, size_t frames, float minMagnitude)
+{
+    const size_t N = fft->paddedSize();
+    const float norm = (float)fft->norm();
+
+    std::fill(x + frames, x + N, 0.f);
+    fft->execute_forward_hc(x);
+
+    // log magnitude (even, real spectrum)
+    float peak = 0.f;
+    for (size_t k=0; k <= N/2; ++k) {
+        const float im = (k > 0) && (k < N/2) ? x[N-k] : 0.f;
+        x[k] = sqrtf(x[k]*x[k] + im*im);
+        peak = std::max(peak, x[k]);
+    }
+    if (peak == 0.f)
+        return;
+    const float floor = peak * minMagnitude;
+    for (size_t k=0; k <= N/2; ++k) {
+        x[k] = logf(std::max(x[k], floor));
+    }
+    std::fill(x + N/2 + 1, x + N, 0.f);
+
+    // real cepstrum, folded onto positive quefrencies
+    fft->execute_backward_hc(x);
+    for (size_t i=1; i < N/2; ++i) {
+        x[i] *= 2.f * norm;
+    }
+    x[0] *= norm;
+    x[N/2] *= norm;
+    std::fill(x + N/2 + 1, x + N, 0.f);
+
+    // minimum phase spectrum exp(FFT(folded cepstrum))
+    fft->execute_forward_hc(x);
+    x[0] = expf(x[0]);
+    x[N/2] = expf(x[N/2]);
+    for (size_t k=1; k < N/2; ++k) {
+        const float m = expf(x[k]);
+        const float phi = x[N-k];
+        x[k] = m * cosf(phi);
+        x[N-k] = m * sinf(phi);
+    }
+    fft->execute_backward_hc(x);
+
+    for (size_t i=0; i < frames; ++i) {
+        x[i] *= norm;
+    }
+}
+
+struct MinPhaseJob
+{
+    VEP::FFT*           fft;
+    float*              data;
+    size_t              frames;
+    size_t              channels;
+    std::vector<float*> scratch;
+};
+
+// minimum phase conversion of channel c
+void minphase_channel(void* arg, size_t c, size_t worker)
+{
+    MinPhaseJob* job = (MinPhaseJob*)arg;
+    float* x = job->scratch[worker];
+    const size_t frames = job->frames;
+    const size_t channels = job->channels;
+    // magnitude floor relative to the peak (-200 dB)
+    const float kMinMagnitude = 1e-10f;
+
+    for (size_t i=0; i < frames; ++i) {
+        x[i] = job->data[i*channels + c];
+    }
+    minimum_phase(job->fft, x, frames, kMinMagnitude);
+    for (size_t i=0; i < frames; ++i) {
+        job->data[i*channels + c] = x[i];
+    }
+}
+
+/** Convert the impulse response in a buffer to minimum phase.
+
+    The magnitude spectrum is kept and the phase replaced by the
+    minimum phase derived from the folded real cepstrum. The FFT is at
+    least four times the buffer length to keep cepstral aliasing low.
+    Channels are converted in parallel. */
+void b_gen_minphase(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    const size_t frames = buf->frames;
+    const size_t channels = buf->channels;
+
+    if ((buf->data == 0) || (frames == 0)) {
+        Print("minphase: invalid buffer\n");
+        return;
+    }
+
+    MinPhaseJob job;
+    job.fft = VEP::FFT::get(VEP::FFT::nextValidSize(2 * frames), false);
+    if (job.fft == 0) {
+        Print("minphase: buffer too long (%d frames)\n", (int)frames);
+        return;
+    }
+    job.data = buf->data;
+    job.frames = frames;
+    job.channels = channels;
+
+    // channels are independent
+    const size_t numWorkers = Workers::numWorkers(channels, channels * job.fft->paddedSize());
+    for (size_t i=0; i < numWorkers; ++i) {
+        job.scratch.push_back(VEP::memAlloc<float>(job.fft->paddedSize()));
+    }
+    Workers::run(numWorkers, channels, minphase_channel, &job);
+    for (size_t i=0; i < numWorkers; ++i) {
+        VEP::memFree(job.scratch[i]);
+    }
+}
+
+/** Minimum phase band limited step (minBLEP) table.
+
+    Arguments: cutoff relative to Nyquist (default 1), number of zero
+    crossings on each side (default 16), oversampling (default 64) and
+    magnitude floor in dB for the minimum phase conversion (default
+    -96), the fc, Nzc, omega and thresh parameters of the Octave
+    minblep function. A Blackman windowed sinc is converted to minimum
+    phase and integrated; the buffer is reallocated with one channel
+    of 2*Nzc*omega+1 frames rising from 0 to 1. */
+void b_gen_minblep(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    const float fc = msg->getf(1.f);
+    const int numZeroCrossings = msg->geti(16);
+    const int oversample = msg->geti(64);
+    const float thresh = msg->getf(-96.f);
+
+    if ((fc <= 0.f) || (fc > 1.f) || (numZeroCrossings < 1) || (oversample < 1)) {
+        Print("minblep: invalid arguments\n");
+        return;
+    }
+
+    const size_t half = (size_t)numZeroCrossings * oversample;
+    const size_t frames = 2 * half + 1;
+    VEP::FFT* fft = VEP::FFT::get(VEP::FFT::nextValidSize(2 * frames), false);
+    if (fft == 0) {
+        Print("minblep: table too long (%d frames)\n", (int)frames);
+        return;
+    }
+
+    // allocates new data; the old data is freed after the command
+    if ((*ft->fBufAlloc)(buf, 1, frames, buf->samplerate) != 0) {
+        Print("minblep: couldn't allocate %d frames\n", (int)frames);
+        return;
+    }
+
+    float* x = VEP::memAlloc<float>(fft->paddedSize());
+
+    // windowed sinc, 'oversample' points per zero crossing
+    for (size_t i=0; i < frames; ++i) {
+        const double t = ((double)i - (double)half) / oversample;
+        const double u = M_PI * fc * t;
+        const double sinc = t == 0. ? 1. : sin(u) / u;
+        const double w = 2. * M_PI * i / (frames - 1);
+        const double blackman = 0.42 - 0.5 * cos(w) + 0.08 * cos(2. * w);
+        x[i] = (float)(fc * sinc * blackman);
+    }
+
+    minimum_phase(fft, x, frames, powf(10.f, thresh / 20.f));
+
+    // integrate and normalize the step to 1
+    double sum = 0.;
+    for (size_t i=0; i < frames; ++i) {
+        sum += x[i];
+        buf->data[i] = (float)sum;
+    }
+    if (sum != 0.) {
+        const float scale = (float)(1. / sum);
+        for (size_t i=0; i < frames; ++i) {
+            buf->data[i] *= scale;
+        }
+    }
+
+    VEP::memFree(x);
+}
+#endif // SKUG_FFTW
+
+/** Windowed sinc interpolation kernel for sample rate conversion.
+
+    The kernel is tabulated at kOversample points per input sample and
+    interpolated linearly between them; its cutoff is lowered to the
+    output Nyquist frequency when downsampling. */
+class ResampleKernel
+{
+public:
+    enum {
+        kZeroCrossings = 32,    // on each side at full bandwidth
+        kOversample = 256       // table points per input sample
+    };
+
+    ResampleKernel(double ratio)
+    {
+        // a little below Nyquist, the transition band ends at Nyquist
+        const double cutoff = 0.95 * std::min(1., ratio);
+        m_halfWidth = kZeroCrossings / cutoff;
+        m_numTaps = 2 * (size_t)ceil(m_halfWidth);
+        m_table.resize((size_t)(m_halfWidth * kOversample) + 2);
+        const double beta = 8.6;
+        const double norm = 1. / bessel_i0(beta);
+        for (size_t i=0; i < m_table.size(); ++i) {
+            const double x = (double)i / kOversample;
+            const double w = x / m_halfWidth;
+            const double sinc = x == 0. ? 1. : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            m_table[i] = w < 1. ? cutoff * sinc * bessel_i0(beta * sqrt(1. - w*w)) * norm : 0.;
+        }
+        m_table.back() = 0.f;
+    }
+
+    size_t numTaps() const { return m_numTaps; }
+
+    // kernel taps for input frames first .. first+numTaps()-1 at
+    // position pos; returns first
+    long taps(double pos, float* h) const
+    {
+        const long first = (long)floor(pos) - (long)m_numTaps/2 + 1;
+        const double limit = m_table.size() - 2;
+        for (size_t k=0; k < m_numTaps; ++k) {
+            const double x = fabs(pos - (double)(first + (long)k)) * kOversample;
+            if (x < limit) {
+                const size_t i = (size_t)x;
+                const float f = (float)(x - i);
+                h[k] = m_table[i] + f * (m_table[i+1] - m_table[i]);
+            } else {
+                h[k] = 0.f;
+            }
+        }
+        return first;
+    }
+
+private:
+    static double bessel_i0(double x)
+    {
+        double sum = 1., term = 1.;
+        for (int k=1; k < 50; ++k) {
+            term *= (x / (2*k)) * (x / (2*k));
+            sum += term;
+            if (term < sum * 1e-12) break;
+        }
+        return sum;
+    }
+
+    double              m_halfWidth;
+    size_t              m_numTaps;
+    std::vector<float>  m_table;
+};
+
+inline float dot(const float* a, const float* b, size_t n)
+{
+    float sum = 0.f;
+#if defined(__SSE__)
+    __m128 vsum = _mm_setzero_ps();
+    for (; n >= 4; n -= 4) {
+        vsum = _mm_add_ps(vsum, _mm_mul_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)));
+        a += 4; b += 4;
+    }
+    float v[4];
+    _mm_storeu_ps(v, vsum);
+    sum = (v[0] + v[1]) + (v[2] + v[3]);
+#endif
+    while (n--) sum += *a++ * *b++;
+    return sum;
+}
+
+struct ResampleJob
+{
+    enum { kBlockSize = 4096 };
+
+    const ResampleKernel*   kernel;
+    double                  ratio;
+    const float*            src;
+    long                    srcFrames;
+    float*                  dst;
+    long                    dstFrames;
+    size_t                  channels;
+    float*                  h;      // numTaps per worker
+};
+
+// output frames [block*kBlockSize, (block+1)*kBlockSize)
+void resample_block(void* arg, size_t block, size_t worker)
+{
+    ResampleJob* job = (ResampleJob*)arg;
+    const float* src = job->src;
+    const long srcFrames = job->srcFrames;
+    const size_t channels = job->channels;
+    const size_t numTaps = job->kernel->numTaps();
+    float* h = job->h + worker * numTaps;
+    const long begin = block * ResampleJob::kBlockSize;
+    const long end = std::min(begin + (long)ResampleJob::kBlockSize, job->dstFrames);
+
+    for (long n=begin; n < end; ++n) {
+        const double pos = n / job->ratio;
+        long first = job->kernel->taps(pos, h);
+        // clip to the input
+        size_t k0 = first < 0 ? -first : 0;
+        size_t k1 = std::min((long)numTaps, srcFrames - first);
+        float* out = job->dst + n*channels;
+        if (k1 <= k0) {
+            std::fill(out, out + channels, 0.f);
+        } else if (channels == 1) {
+            out[0] = dot(&h[k0], src + first + k0, k1 - k0);
+        } else {
+            std::fill(out, out + channels, 0.f);
+            for (size_t k=k0; k < k1; ++k) {
+                VEP::DSP::axpy(out, h[k], src + (first + k)*channels, channels);
+            }
+        }
+    }
+}
+
+/** Convert the sample rate of a buffer.
+
+    Arguments: the new sample rate (default: the server sample rate).
+    The buffer is reallocated with the new frame count; the old data
+    is freed by the server. Multichannel frames are filtered with
+    vector operations across channels; blocks of output frames are
+    computed in parallel. */
+void b_gen_resample(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    const double srcRate = buf->samplerate;
+    double dstRate = msg->getf(0.f);
+    if (dstRate <= 0.) dstRate = world->mSampleRate;
+
+    if ((buf->data == 0) || (buf->frames == 0) || (srcRate <= 0.)) {
+        Print("resample: invalid buffer\n");
+        return;
+    }
+    if (dstRate == srcRate)
+        return;
+
+    const float* src = buf->data;
+    const long srcFrames = buf->frames;
+    const size_t channels = buf->channels;
+    const double ratio = dstRate / srcRate;
+    const long dstFrames = std::max(1L, (long)floor(srcFrames * ratio + 0.5));
+
+    // allocates new data; the old data is freed after the command
+    if ((*ft->fBufAlloc)(buf, channels, dstFrames, dstRate) != 0) {
+        Print("resample: couldn't allocate %ld frames\n", dstFrames);
+        return;
+    }
+
+    const ResampleKernel kernel(ratio);
+    ResampleJob job = { &kernel, ratio, src, srcFrames, buf->data, dstFrames, channels };
+
+    // blocks of output frames are independent
+    const size_t numBlocks = (dstFrames + ResampleJob::kBlockSize - 1) / ResampleJob::kBlockSize;
+    const size_t numWorkers = Workers::numWorkers(numBlocks, dstFrames * channels);
+    std::vector<float> h(numWorkers * kernel.numTaps());
+    job.h = &h[0];
+    Workers::run(numWorkers, numBlocks, resample_block, &job);
+}
+
+/** Remove leading and trailing silence.
+
+    Arguments: threshold in dB relative to the buffer peak (default
+    -90). Frames before the first and after the last frame above the
+    threshold in any channel are removed and the buffer is reallocated
+    with the new frame count, which is printed. */
+void b_gen_trim(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    const float threshold = msg->getf(-90.f);
+    const float* data = buf->data;
+    const size_t frames = buf->frames;
+    const size_t channels = buf->channels;
+
+    if ((data == 0) || (frames == 0)) {
+        Print("trim: invalid buffer\n");
+        return;
+    }
+
+    float peak = 0.f;
+    for (size_t i=0; i < frames*channels; ++i) {
+        peak = std::max(peak, fabsf(data[i]));
+    }
+    if (peak == 0.f) {
+        Print("trim: buffer is silent\n");
+        return;
+    }
+
+    const float level = peak * powf(10.f, threshold / 20.f);
+    size_t begin = frames, end = 0;
+    for (size_t i=0; i < frames; ++i) {
+        for (size_t c=0; c < channels; ++c) {
+            if (fabsf(data[i*channels + c]) >= level) {
+                begin = std::min(begin, i);
+                end = i + 1;
+                break;
+            }
+        }
+    }
+
+    if ((begin == 0) && (end == frames))
+        return;
+
+    // allocates new data; the old data is freed after the command
+    if ((*ft->fBufAlloc)(buf, channels, end - begin, buf->samplerate) != 0) {
+        Print("trim: couldn't allocate %d frames\n", (int)(end - begin));
+        return;
+    }
+    memCopy(buf->data, data + begin*channels, (end - begin)*channels);
+
+    Print("trim: %d frames from %d (was %d)\n", (int)(end - begin), (int)begin, (int)frames);
+}
+
+/** Fused elementwise processing of an interleaved buffer.
+
+    Pending operations are kept in the form
+
+        y[i][c] = scale * envelope(i) * (x[i][c] + offset[c])
+
+    with the frames optionally written in reverse order, and are applied
+    by flush() in a single pass over the buffer. The pass also gathers
+    the mean and the range of each channel of its result, from which
+    later dc and normalize steps are folded into the next pass. Fades
+    are kept in source frame indices; a fade after a reversal becomes
+    the opposite fade. Passes over large buffers are split into blocks
+    of frames for the workers, each with its own statistics. */
+class BufferPipeline
+{
+public:
+    // frames, or pairs of frames when reversing, per worker task
+    enum { kBlockSize = 16384 };
+
+    enum Op
+    {
+        kGain,
+        kFadeIn,
+        kFadeOut,
+        kDC,
+        kNormalize,
+        kReverse,
+        kRotate
+    };
+
+    struct Step
+    {
+        Op      op;
+        float   arg;
+    };
+
+    BufferPipeline(float* data, size_t frames, size_t channels)
+        : m_data(data), m_frames(frames), m_channels(channels),
+          m_scale(1.f), m_offset(channels, 0.f), m_reverse(false),
+          m_haveStats(false), m_stats(channels),
+          m_frame(channels),
+          m_workers(0), m_numPasses(0)
+    { }
+
+    size_t numPasses() const { return m_numPasses; }
+
+    void run(const Step& step)
+    {
+        switch (step.op) {
+            case kGain:      gain(step.arg); break;
+            case kFadeIn:    fade((size_t)std::max(step.arg, 0.f), false); break;
+            case kFadeOut:   fade((size_t)std::max(step.arg, 0.f), true); break;
+            case kDC:        dc(); break;
+            case kNormalize: normalize(step.arg); break;
+            case kReverse:   reverse(); break;
+            case kRotate:    rotate(step.arg); break;
+        }
+    }
+
+    void gain(float amp)
+    {
+        m_scale *= amp;
+    }
+    void fade(size_t length, bool out)
+    {
+        if (length > 0)
+            m_fades.push_back(Fade(std::min(length, m_frames), out != m_reverse));
+    }
+    void reverse()
+    {
+        m_reverse = !m_reverse;
+    }
+    // subtract the mean of each channel
+    void dc()
+    {
+        prepareStats();
+        for (size_t c=0; c < m_channels; ++c) {
+            m_offset[c] = (float)(-m_stats.sum[c] / m_frames);
+        }
+    }
+    // scale the peak over all channels to 'level'
+    void normalize(float level)
+    {
+        prepareStats();
+        float peak = 0.f;
+        for (size_t c=0; c < m_channels; ++c) {
+            peak = std::max(peak, fabsf(m_stats.max[c] + m_offset[c]));
+            peak = std::max(peak, fabsf(m_stats.min[c] + m_offset[c]));
+        }
+        peak *= fabsf(m_scale);
+        if (peak > 0.f) m_scale *= level / peak;
+    }
+    // like b_gen_rotate, but with frame reversals; the reversal of the
+    // whole buffer is done by the pending pass
+    void rotate(float shift)
+    {
+        size_t irot;
+        float frac;
+        split_rotation(shift, m_frames, irot, frac);
+        if (irot > 0) {
+            m_reverse = !m_reverse;
+            flush();
+            reverseFrames(m_data, irot);
+            reverseFrames(m_data + irot*m_channels, m_frames - irot);
+            m_numPasses++;
+        }
+        if (frac > 0.f) {
+            flush();
+            fractional_delay(m_data, m_frames, m_channels, frac);
+            m_haveStats = false;
+            m_numPasses++;
+        }
+    }
+
+    // apply the pending operations
+    void flush()
+    {
+        if (isIdentity())
+            return;
+
+        const size_t n = m_frames;
+        runPass(m_reverse ? n/2 : n, applyBlock);
+        if (m_reverse && (n & 1)) {
+            // middle frame
+            float* x = m_data + (n/2)*m_channels;
+            apply(x, x, n/2, m_stats);
+        }
+        m_haveStats = true;
+        m_numPasses++;
+
+        m_scale = 1.f;
+        std::fill(m_offset.begin(), m_offset.end(), 0.f);
+        m_fades.clear();
+        m_reverse = false;
+    }
+
+protected:
+    // statistics of each channel
+    struct Stats
+    {
+        Stats(size_t channels)
+            : sum(channels), min(channels), max(channels)
+        {
+            clear();
+        }
+        void clear()
+        {
+            std::fill(sum.begin(), sum.end(), 0.);
+            std::fill(min.begin(), min.end(), HUGE_VALF);
+            std::fill(max.begin(), max.end(), -HUGE_VALF);
+        }
+        void merge(const Stats& other)
+        {
+            for (size_t c=0; c < sum.size(); ++c) {
+                sum[c] += other.sum[c];
+                min[c] = std::min(min[c], other.min[c]);
+                max[c] = std::max(max[c], other.max[c]);
+            }
+        }
+        std::vector<double> sum;
+        std::vector<float>  min;
+        std::vector<float>  max;
+    };
+
+    // per worker state of a pass
+    struct Worker
+    {
+        Worker(size_t channels)
+            : stats(channels), frame(2*channels)
+        { }
+        Stats               stats;
+        std::vector<float>  frame;
+    };
+
+    struct Fade
+    {
+        Fade(size_t length_, bool out_)
+            : length(length_), out(out_)
+        { }
+        size_t  length;
+        bool    out;
+    };
+
+    bool isIdentity() const
+    {
+        if ((m_scale != 1.f) || m_reverse || !m_fades.empty())
+            return false;
+        for (size_t c=0; c < m_channels; ++c) {
+            if (m_offset[c] != 0.f) return false;
+        }
+        return true;
+    }
+
+    float envelope(size_t i) const
+    {
+        float g = 1.f;
+        for (size_t k=0; k < m_fades.size(); ++k) {
+            const Fade& f = m_fades[k];
+            const size_t d = f.out ? m_frames - 1 - i : i;
+            if (d < f.length) g *= (float)d / f.length;
+        }
+        return g;
+    }
+
+    void apply(float* y, const float* x, size_t i, Stats& stats) const
+    {
+        const float g = m_scale * envelope(i);
+        for (size_t c=0; c < m_channels; ++c) {
+            const float z = g * (x[c] + m_offset[c]);
+            y[c] = z;
+            stats.sum[c] += z;
+            stats.min[c] = std::min(stats.min[c], z);
+            stats.max[c] = std::max(stats.max[c], z);
+        }
+    }
+
+    // run a pass over 'numItems' frames or frame pairs in blocks and
+    // collect the statistics of the workers
+    void runPass(size_t numItems, Workers::TaskFunc fn)
+    {
+        const size_t numBlocks = (numItems + kBlockSize - 1) / kBlockSize;
+        const size_t numWorkers = Workers::numWorkers(numBlocks, m_frames * m_channels);
+        std::vector<Worker> workers(numWorkers, Worker(m_channels));
+        m_workers = &workers[0];
+        Workers::run(numWorkers, numBlocks, fn, this);
+        m_workers = 0;
+        m_stats.clear();
+        for (size_t i=0; i < numWorkers; ++i) {
+            m_stats.merge(workers[i].stats);
+        }
+    }
+
+    static void applyBlock(void* arg, size_t block, size_t worker)
+    {
+        BufferPipeline* self = (BufferPipeline*)arg;
+        Worker& w = self->m_workers[worker];
+        const size_t n = self->m_frames;
+        const size_t nc = self->m_channels;
+        const size_t begin = block * kBlockSize;
+        if (self->m_reverse) {
+            // swap frame pairs from both ends
+            const size_t end = std::min(begin + kBlockSize, n/2);
+            for (size_t i=begin; i < end; ++i) {
+                const size_t j = n - 1 - i;
+                float* a = self->m_data + i*nc;
+                float* b = self->m_data + j*nc;
+                self->apply(&w.frame[0], a, i, w.stats);
+                self->apply(&w.frame[nc], b, j, w.stats);
+                memCopy(a, &w.frame[nc], nc);
+                memCopy(b, &w.frame[0], nc);
+            }
+        } else {
+            const size_t end = std::min(begin + kBlockSize, n);
+            float* x = self->m_data + begin*nc;
+            for (size_t i=begin; i < end; ++i, x += nc) {
+                self->apply(x, x, i, w.stats);
+            }
+        }
+    }
+
+    static void scanBlock(void* arg, size_t block, size_t worker)
+    {
+        BufferPipeline* self = (BufferPipeline*)arg;
+        Stats& stats = self->m_workers[worker].stats;
+        const size_t nc = self->m_channels;
+        const size_t begin = block * kBlockSize;
+        const size_t end = std::min(begin + kBlockSize, self->m_frames);
+        const float* x = self->m_data + begin*nc;
+        for (size_t i=begin; i < end; ++i, x += nc) {
+            for (size_t c=0; c < nc; ++c) {
+                stats.sum[c] += x[c];
+                stats.min[c] = std::min(stats.min[c], x[c]);
+                stats.max[c] = std::max(stats.max[c], x[c]);
+            }
+        }
+    }
+
+    // statistics of the input of the pending pass; fades don't commute
+    // with dc and normalize, so they are applied first
+    void prepareStats()
+    {
+        if (!m_fades.empty())
+            flush();
+        if (m_haveStats)
+            return;
+        runPass(m_frames, scanBlock);
+        m_haveStats = true;
+        m_numPasses++;
+    }
+
+    void reverseFrames(float* data, size_t n)
+    {
+        if (m_channels == 1) {
+            ::reverse(data, n);
+            return;
+        }
+        const size_t nc = m_channels;
+        float* a = data;
+        float* b = data + n*nc;
+        while (b - a > (ptrdiff_t)nc) {
+            b -= nc;
+            memCopy(&m_frame[0], a, nc);
+            memCopy(a, b, nc);
+            memCopy(b, &m_frame[0], nc);
+            a += nc;
+        }
+    }
+
+private:
+    float*              m_data;
+    size_t              m_frames;
+    size_t              m_channels;
+    // pending operations
+    float               m_scale;
+    std::vector<float>  m_offset;
+    std::vector<Fade>   m_fades;
+    bool                m_reverse;
+    // statistics of the buffer contents
+    bool                m_haveStats;
+    Stats               m_stats;
+    std::vector<float>  m_frame;
+    Worker*             m_workers;
+    size_t              m_numPasses;
+};
+
+/** Optional numeric argument of a pipeline step; the next operation name
+    ends the arguments. */
+inline float pipeline_arg(sc_msg_iter* msg, float defaultValue)
+{
+    if ((msg->remain() <= 0) || (msg->nextTag() == 's'))
+        return defaultValue;
+    return msg->getf(defaultValue);
+}
+
+/** Prepare a buffer with a chain of operations in as few passes as
+    possible.
+
+    Arguments: a list of operations, each a name followed by its
+    arguments, applied in order:
+
+        gain <amp>              scale by amp
+        fadein <frames>         linear fade in over the first frames
+        fadeout <frames>        linear fade out over the last frames
+        dc                      remove the DC offset of each channel
+        normalize [<level>]     scale the peak to level (default 1)
+        reverse                 reverse the frames
+        rotate <frames>         rotate like /b_gen rotate
+
+    Elementwise operations and reversals are fused into a single pass
+    over the buffer. A chain like 'dc normalize fadein fadeout gain'
+    costs one read pass for the statistics and one read/write pass;
+    dc and normalize after a fade, and rotations, start a new pass. The
+    whole list is checked before the buffer is touched. */
+void b_gen_pipeline(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    if ((buf->data == 0) || (buf->frames == 0)) {
+        Print("pipeline: invalid buffer\n");
+        return;
+    }
+
+    std::vector<BufferPipeline::Step> steps;
+    while (msg->remain() > 0) {
+        const char* name = msg->gets();
+        if (name == 0) {
+            Print("pipeline: expected an operation name\n");
+            return;
+        }
+        BufferPipeline::Step step;
+        if (strcmp(name, "gain") == 0) {
+            step.op = BufferPipeline::kGain;
+            step.arg = pipeline_arg(msg, 1.f);
+        } else if (strcmp(name, "fadein") == 0) {
+            step.op = BufferPipeline::kFadeIn;
+            step.arg = pipeline_arg(msg, 0.f);
+        } else if (strcmp(name, "fadeout") == 0) {
+            step.op = BufferPipeline::kFadeOut;
+            step.arg = pipeline_arg(msg, 0.f);
+        } else if (strcmp(name, "dc") == 0) {
+            step.op = BufferPipeline::kDC;
+            step.arg = 0.f;
+        } else if (strcmp(name, "normalize") == 0) {
+            step.op = BufferPipeline::kNormalize;
+            step.arg = pipeline_arg(msg, 1.f);
+        } else if (strcmp(name, "reverse") == 0) {
+            step.op = BufferPipeline::kReverse;
+            step.arg = 0.f;
+        } else if (strcmp(name, "rotate") == 0) {
+            step.op = BufferPipeline::kRotate;
+            step.arg = pipeline_arg(msg, 0.f);
+        } else {
+            Print("pipeline: unknown operation %s\n", name);
+            return;
+        }
+        steps.push_back(step);
+    }
+
+    BufferPipeline pipeline(buf->data, buf->frames, buf->channels);
+    for (size_t i=0; i < steps.size(); ++i) {
+        pipeline.run(steps[i]);
+    }
+    pipeline.flush();
+}
+
+/** Transpose of a row major matrix, dst[c*rows + r] = src[r*cols + c].
+
+    The matrix is split into tiles of kTileSize x kTileSize elements,
+    which fit into the L1 cache together with their transpose, and
+    tiles into 4x4 blocks transposed with SSE shuffles. Workers run
+    strips of tiles along the longer dimension. */
+struct TransposeJob
+{
+    enum {
+        kTileSize = 32,
+        kStripSize = 1024       // along the longer dimension
+    };
+
+    float*          dst;
+    const float*    src;
+    size_t          rows;
+    size_t          cols;
+
+    size_t numStrips() const
+    {
+        return (std::max(rows, cols) + kStripSize - 1) / kStripSize;
+    }
+};
+
+// rows [r0, r1) x columns [c0, c1)
+inline void transpose_tile(float* dst, const float* src, size_t rows, size_t cols,
+                           size_t r0, size_t r1, size_t c0, size_t c1)
+{
+    size_t r = r0;
+#if defined(__SSE__)
+    for (; r + 4 <= r1; r += 4) {
+        size_t c = c0;
+        for (; c + 4 <= c1; c += 4) {
+            const float* s = src + r*cols + c;
+            __m128 x0 = _mm_loadu_ps(s);
+            __m128 x1 = _mm_loadu_ps(s + cols);
+            __m128 x2 = _mm_loadu_ps(s + 2*cols);
+            __m128 x3 = _mm_loadu_ps(s + 3*cols);
+            _MM_TRANSPOSE4_PS(x0, x1, x2, x3);
+            float* d = dst + c*rows + r;
+            _mm_storeu_ps(d, x0);
+            _mm_storeu_ps(d + rows, x1);
+            _mm_storeu_ps(d + 2*rows, x2);
+            _mm_storeu_ps(d + 3*rows, x3);
+        }
+        for (; c < c1; ++c) {
+            for (size_t k=0; k < 4; ++k) {
+                dst[c*rows + r + k] = src[(r + k)*cols + c];
+            }
+        }
+    }
+#endif
+    for (; r < r1; ++r) {
+        for (size_t c=c0; c < c1; ++c) {
+            dst[c*rows + r] = src[r*cols + c];
+        }
+    }
+}
+
+void transpose_strip(void* arg, size_t strip, size_t worker)
+{
+    const TransposeJob* job = (const TransposeJob*)arg;
+    const size_t T = TransposeJob::kTileSize;
+    const size_t begin = strip * TransposeJob::kStripSize;
+    size_t r0 = 0, r1 = job->rows, c0 = 0, c1 = job->cols;
+    if (job->rows >= job->cols) {
+        r0 = begin;
+        r1 = std::min(begin + TransposeJob::kStripSize, job->rows);
+    } else {
+        c0 = begin;
+        c1 = std::min(begin + TransposeJob::kStripSize, job->cols);
+    }
+    for (size_t r=r0; r < r1; r += T) {
+        for (size_t c=c0; c < c1; c += T) {
+            transpose_tile(job->dst, job->src, job->rows, job->cols,
+                           r, std::min(r + T, r1), c, std::min(c + T, c1));
+        }
+    }
+}
+
+// reallocate the buffer and transpose its data into the new memory
+void transpose_buffer(SndBuf* buf, size_t rows, size_t cols, const char* name)
+{
+    const float* src = buf->data;
+    // allocates new data; the old data is freed after the command
+    if ((*ft->fBufAlloc)(buf, buf->channels, buf->frames, buf->samplerate) != 0) {
+        Print("%s: couldn't allocate %d frames\n", name, buf->frames);
+        return;
+    }
+    TransposeJob job = { buf->data, src, rows, cols };
+    const size_t numWorkers = Workers::numWorkers(job.numStrips(), rows * cols);
+    Workers::run(numWorkers, job.numStrips(), transpose_strip, &job);
+}
+
+/** Convert an interleaved buffer to planar layout.
+
+    Channel c then occupies the frames contiguous samples starting at
+    c*frames, so that analysis code and kernel setup can read channels
+    without striding. The buffer header is unchanged: the server and
+    UGens still see interleaved frames, so the buffer should only be
+    played after /b_gen interleave. The data is reallocated. */
+void b_gen_deinterleave(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    if (buf->data == 0) {
+        Print("deinterleave: invalid buffer\n");
+        return;
+    }
+    if ((buf->channels > 1) && (buf->frames > 0))
+        transpose_buffer(buf, buf->frames, buf->channels, "deinterleave");
+}
+
+/** Convert a planar buffer (see /b_gen deinterleave) back to
+    interleaved layout. */
+void b_gen_interleave(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    if (buf->data == 0) {
+        Print("interleave: invalid buffer\n");
+        return;
+    }
+    if ((buf->channels > 1) && (buf->frames > 0))
+        transpose_buffer(buf, buf->channels, buf->frames, "interleave");
+}
+
+struct RemapJob
+{
+    enum { kBlockSize = 4096 };
+
+    float*              dst;
+    const float*        src;
+    size_t              frames;
+    size_t              srcChannels;
+    // source channel of each output channel; -1 for silence
+    std::vector<int>    map;
+};
+
+// frames [block*kBlockSize, (block+1)*kBlockSize)
+void remap_block(void* arg, size_t block, size_t worker)
+{
+    const RemapJob* job = (const RemapJob*)arg;
+    const size_t dstChannels = job->map.size();
+    const size_t begin = block * RemapJob::kBlockSize;
+    const size_t end = std::min(begin + RemapJob::kBlockSize, job->frames);
+    const int* map = &job->map[0];
+    const float* x = job->src + begin*job->srcChannels;
+    float* y = job->dst + begin*dstChannels;
+    for (size_t i=begin; i < end; ++i, x += job->srcChannels, y += dstChannels) {
+        for (size_t c=0; c < dstChannels; ++c) {
+            y[c] = map[c] < 0 ? 0.f : x[map[c]];
+        }
+    }
+}
+
+/** Reorder, select or duplicate the channels of a buffer.
+
+    Arguments: the source channel of each channel of the result, whose
+    channel count is the number of arguments. Negative or out of range
+    channels are silent. The data is reallocated. */
+void b_gen_remap(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    if ((buf->data == 0) || (buf->frames == 0)) {
+        Print("remap: invalid buffer\n");
+        return;
+    }
+
+    RemapJob job;
+    job.src = buf->data;
+    job.frames = buf->frames;
+    job.srcChannels = buf->channels;
+    while (msg->remain() > 0) {
+        const int c = msg->geti(-1);
+        job.map.push_back(c < buf->channels ? c : -1);
+    }
+    if (job.map.empty()) {
+        Print("remap: no channels\n");
+        return;
+    }
+
+    // allocates new data; the old data is freed after the command
+    if ((*ft->fBufAlloc)(buf, job.map.size(), buf->frames, buf->samplerate) != 0) {
+        Print("remap: couldn't allocate %d channels\n", (int)job.map.size());
+        return;
+    }
+    job.dst = buf->data;
+
+    const size_t numBlocks = (job.frames + RemapJob::kBlockSize - 1) / RemapJob::kBlockSize;
+    const size_t numWorkers = Workers::numWorkers(numBlocks, job.frames * job.map.size());
+    Workers::run(numWorkers, numBlocks, remap_block, &job);
+}
+
+/** Statistics of each channel of a range of frames. */
+struct ChannelStats
+{
+    ChannelStats(size_t channels)
+        : peak(channels), sum(channels), energy(channels),
+          first(channels), last(channels)
+    {
+        clear();
+    }
+    void clear()
+    {
+        std::fill(peak.begin(), peak.end(), 0.f);
+        std::fill(sum.begin(), sum.end(), 0.);
+        std::fill(energy.begin(), energy.end(), 0.);
+        std::fill(first.begin(), first.end(), -1L);
+        std::fill(last.begin(), last.end(), -1L);
+    }
+    // sample x of frame i in channel c
+    void add(size_t c, float x, long i, float threshold)
+    {
+        const float a = fabsf(x);
+        peak[c] = std::max(peak[c], a);
+        sum[c] += x;
+        energy[c] += x*x;
+        if (a >= threshold) {
+            if (first[c] < 0) first[c] = i;
+            last[c] = i;
+        }
+    }
+    // merge statistics of frames from the same or another range
+    void merge(size_t c, float peak_, double sum_, double energy_, long first_, long last_)
+    {
+        peak[c] = std::max(peak[c], peak_);
+        sum[c] += sum_;
+        energy[c] += energy_;
+        if ((first_ >= 0) && ((first[c] < 0) || (first_ < first[c]))) first[c] = first_;
+        last[c] = std::max(last[c], last_);
+    }
+    void merge(const ChannelStats& other)
+    {
+        for (size_t c=0; c < peak.size(); ++c) {
+            merge(c, other.peak[c], other.sum[c], other.energy[c], other.first[c], other.last[c]);
+        }
+    }
+
+    std::vector<float>  peak;
+    std::vector<double> sum;
+    std::vector<double> energy;
+    // first and last frame at or above the threshold, -1 if none
+    std::vector<long>   first;
+    std::vector<long>   last;
+};
+
+#if defined(__SSE2__)
+/** Statistics of four lanes; frame indices are 32 bit integers. */
+struct LaneStats
+{
+    LaneStats(__m128 threshold_)
+        : threshold(threshold_),
+          peak(_mm_setzero_ps()), sum(_mm_setzero_ps()), energy(_mm_setzero_ps()),
+          first(_mm_set1_epi32(-1)), last(_mm_set1_epi32(-1))
+    { }
+
+    // samples x of frames i
+    void add(__m128 x, __m128i i)
+    {
+        const __m128 a = _mm_andnot_ps(_mm_set1_ps(-0.f), x);
+        peak = _mm_max_ps(peak, a);
+        sum = _mm_add_ps(sum, x);
+        energy = _mm_add_ps(energy, _mm_mul_ps(x, x));
+        const __m128i m = _mm_castps_si128(_mm_cmpge_ps(a, threshold));
+        last = _mm_or_si128(_mm_and_si128(m, i), _mm_andnot_si128(m, last));
+        const __m128i mf = _mm_and_si128(m, _mm_cmpeq_epi32(first, _mm_set1_epi32(-1)));
+        first = _mm_or_si128(_mm_and_si128(mf, i), _mm_andnot_si128(mf, first));
+    }
+
+    // merge lane l into channel c + l % numChannels
+    void store(ChannelStats& s, size_t c, size_t numChannels) const
+    {
+        float p[4], x[4], e[4];
+        int f[4], l[4];
+        _mm_storeu_ps(p, peak);
+        _mm_storeu_ps(x, sum);
+        _mm_storeu_ps(e, energy);
+        _mm_storeu_si128((__m128i*)f, first);
+        _mm_storeu_si128((__m128i*)l, last);
+        for (size_t k=0; k < 4; ++k) {
+            s.merge(c + k % numChannels, p[k], x[k], e[k], f[k], l[k]);
+        }
+    }
+
+    __m128  threshold;
+    __m128  peak;
+    __m128  sum;
+    __m128  energy;
+    __m128i first;
+    __m128i last;
+};
+#endif // __SSE2__
+
+/** Statistics of frames [begin, end) of an interleaved buffer into 's'.
+
+    Sums are accumulated in single precision, so ranges should be
+    short. Mono and stereo buffers put consecutive frames into the
+    vector lanes, other channel counts groups of four channels; the
+    remaining channels are scalar. */
+inline void analyze_range(const float* data, size_t channels, size_t begin, size_t end,
+                          float threshold, ChannelStats& s)
+{
+    s.clear();
+    size_t c0 = 0;
+#if defined(__SSE2__)
+    const __m128 thr = _mm_set1_ps(threshold);
+    if ((channels == 1) || (channels == 2)) {
+        const size_t n = (end - begin) * channels;
+        const float* x = data + begin*channels;
+        // lane l holds channel l % channels of frame l / channels
+        const int b = (int)begin;
+        __m128i i = channels == 1 ? _mm_setr_epi32(b, b+1, b+2, b+3) : _mm_setr_epi32(b, b, b+1, b+1);
+        const __m128i step = _mm_set1_epi32(4 / (int)channels);
+        LaneStats ls(thr);
+        size_t k = 0;
+        for (; k + 4 <= n; k += 4) {
+            ls.add(_mm_loadu_ps(x + k), i);
+            i = _mm_add_epi32(i, step);
+        }
+        ls.store(s, 0, channels);
+        for (; k < n; ++k) {
+            s.add(k % channels, x[k], (long)(begin + k / channels), threshold);
+        }
+        return;
+    }
+    for (; c0 + 4 <= channels; c0 += 4) {
+        const float* x = data + begin*channels + c0;
+        __m128i i = _mm_set1_epi32((int)begin);
+        const __m128i one = _mm_set1_epi32(1);
+        LaneStats ls(thr);
+        for (size_t j=begin; j < end; ++j, x += channels) {
+            ls.add(_mm_loadu_ps(x), i);
+            i = _mm_add_epi32(i, one);
+        }
+        ls.store(s, c0, 4);
+    }
+#endif // __SSE2__
+    if (c0 < channels) {
+        const float* x = data + begin*channels;
+        for (size_t j=begin; j < end; ++j, x += channels) {
+            for (size_t c=c0; c < channels; ++c) {
+                s.add(c, x[c], (long)j, threshold);
+            }
+        }
+    }
+}
+
+struct AnalyzeJob
+{
+    enum {
+        kRangeSamples = 16384,  // single precision accumulation, L2 cache
+        kTaskFrames = 65536
+    };
+
+    const float*                data;
+    size_t                      frames;
+    size_t                      channels;
+    float                       threshold;
+    size_t                      blockSize;
+    size_t                      taskSize;
+    // per worker totals and range statistics
+    std::vector<ChannelStats>   totals;
+    std::vector<ChannelStats>   ranges;
+    // energy of each block of each channel
+    std::vector<double>         blockEnergy;
+};
+
+// frames [task*taskSize, (task+1)*taskSize); tasks consist of whole blocks
+void analyze_task(void* arg, size_t task, size_t worker)
+{
+    AnalyzeJob* job = (AnalyzeJob*)arg;
+    ChannelStats& range = job->ranges[worker];
+    const size_t rangeSize = std::max((size_t)16, (size_t)AnalyzeJob::kRangeSamples / job->channels);
+    const size_t begin = task * job->taskSize;
+    const size_t end = std::min(begin + job->taskSize, job->frames);
+    for (size_t i=begin; i < end; ) {
+        size_t n = std::min(end - i, rangeSize);
+        if (job->blockSize > 0)
+            n = std::min(n, job->blockSize - i % job->blockSize);
+        analyze_range(job->data, job->channels, i, i + n, job->threshold, range);
+        job->totals[worker].merge(range);
+        if (job->blockSize > 0) {
+            double* e = &job->blockEnergy[(i / job->blockSize) * job->channels];
+            for (size_t c=0; c < job->channels; ++c) {
+                e[c] += range.energy[c];
+            }
+        }
+        i += n;
+    }
+}
+
+/** Write statistics of each channel into a result buffer.
+
+    Arguments: result bufnum, silence threshold in dBFS (default -90),
+    block size in frames for the energy per block (default 0: none).
+    Frames of the result buffer hold, for each of its channels:
+
+        0   peak
+        1   RMS
+        2   DC offset
+        3,4 first frame at or above the threshold
+        5,6 last frame at or above the threshold
+        7.. energy (sum of squares) of consecutive blocks
+
+    Frame indices are split into index / 65536 and index % 65536, so
+    that they stay exact in single precision beyond 2^24 frames; both
+    values are -1 if the channel is silent.
+
+    as far as the result buffer is large enough; remaining frames are
+    zeroed. The buffer is read once with vectorized reductions, so
+    clients don't need to fetch it with /b_getn. A b_gen can't send
+    custom replies; query the result with /b_getn. */
+void b_gen_analyze(World* world, SndBuf* buf, sc_msg_iter* msg)
+{
+    enum { kPeak, kRMS, kDC, kFirst, kLast = kFirst + 2, kNumStats = kLast + 2 };
+
+    const int resultNum = msg->geti(-1);
+    const float threshold = msg->getf(-90.f);
+    const int blockSize = msg->geti(0);
+    SndBuf* result = getNRTBuf(world, resultNum);
+
+    if ((buf->data == 0) || (buf->frames == 0)) {
+        Print("analyze: invalid buffer\n");
+        return;
+    }
+    if ((result == 0) || (result->data == 0) || (result->frames < kNumStats)) {
+        Print("analyze: result buffer needs at least %d frames\n", (int)kNumStats);
+        return;
+    }
+
+    AnalyzeJob job;
+    job.data = buf->data;
+    job.frames = buf->frames;
+    job.channels = buf->channels;
+    job.threshold = powf(10.f, threshold / 20.f);
+    job.blockSize = std::max(0, blockSize);
+    job.taskSize = job.blockSize > 0
+        ? job.blockSize * std::max((size_t)1, (size_t)AnalyzeJob::kTaskFrames / job.blockSize)
+        : (size_t)AnalyzeJob::kTaskFrames;
+    const size_t numBlocks = job.blockSize > 0 ? (job.frames + job.blockSize - 1) / job.blockSize : 0;
+    job.blockEnergy.resize(numBlocks * job.channels, 0.);
+
+    const size_t numTasks = (job.frames + job.taskSize - 1) / job.taskSize;
+    const size_t numWorkers = Workers::numWorkers(numTasks, job.frames * job.channels);
+    job.totals.resize(numWorkers, ChannelStats(job.channels));
+    job.ranges.resize(numWorkers, ChannelStats(job.channels));
+    Workers::run(numWorkers, numTasks, analyze_task, &job);
+    for (size_t i=1; i < numWorkers; ++i) {
+        job.totals[0].merge(job.totals[i]);
+    }
+    const ChannelStats& s = job.totals[0];
+
+    // the result may be the analyzed buffer
+    const size_t resultChannels = result->channels;
+    const size_t resultBlocks = std::min(numBlocks, (size_t)result->frames - kNumStats);
+    std::fill(result->data, result->data + result->samples, 0.f);
+    for (size_t c=0; c < std::min(resultChannels, job.channels); ++c) {
+        float* y = result->data + c;
+        y[kPeak*resultChannels]  = s.peak[c];
+        y[kRMS*resultChannels]   = (float)sqrt(s.energy[c] / job.frames);
+        y[kDC*resultChannels]    = (float)(s.sum[c] / job.frames);
+        y[kFirst*resultChannels]     = (float)(s.first[c] < 0 ? -1 : s.first[c] / 65536);
+        y[(kFirst+1)*resultChannels] = (float)(s.first[c] < 0 ? -1 : s.first[c] % 65536);
+        y[kLast*resultChannels]      = (float)(s.last[c] < 0 ? -1 : s.last[c] / 65536);
+        y[(kLast+1)*resultChannels]  = (float)(s.last[c] < 0 ? -1 : s.last[c] % 65536);
+        for (size_t k=0; k < resultBlocks; ++k) {
+            y[(kNumStats + k)*resultChannels] = (float)job.blockEnergy[k*job.channels + c];
+        }
     }
 }
 
@@ -81,4 +1708,16 @@ void load(InterfaceTable *inTable)
 {
     ft = inTable;
     DefineBufGen("rotate", &b_gen_rotate);
+    DefineBufGen("resample", &b_gen_resample);
+    DefineBufGen("trim", &b_gen_trim);
+    DefineBufGen("pipeline", &b_gen_pipeline);
+    DefineBufGen("deinterleave", &b_gen_deinterleave);
+    DefineBufGen("interleave", &b_gen_interleave);
+    DefineBufGen("remap", &b_gen_remap);
+    DefineBufGen("analyze", &b_gen_analyze);
+#if SKUG_FFTW
+    DefineBufGen("fftconv", &b_gen_fftconv);
+    DefineBufGen("minphase", &b_gen_minphase);
+    DefineBufGen("minblep", &b_gen_minblep);
+#endif // SKUG_FFTW
 }
@@ -25,15 +25,317 @@
 #include <SC_Reply.h>
 #include <scsynthsend.h>
 
+#include <algorithm>
+#include <string.h>
+#include <sys/time.h>
+
 static InterfaceTable *ft;
 
+// =====================================================================
+// Trigger batches
+//
+// Triggers are collected in the RT thread and sent to all registered
+// clients from the NRT thread. A single trigger is sent as a plain /tr
+// message, several as one bundle of /tr messages, as understood by
+// every client. With timestamps enabled, every /tr message is wrapped
+// in a nested bundle timestamped with the time of its sample instead.
+// Times are derived from the sample clock and anchored at the system
+// time when the batch is sent, so they are exact relative to each
+// other.
+
+// trigger, followed by numValues floats
+struct TrigEvent
+{
+    int32   nodeID;
+    int32   id;
+    int64   sample;         // sample clock
+    int32   numValues;
+    int32   pad;
+
+    static size_t size(size_t numValues)
+    {
+        return (sizeof(TrigEvent) + numValues * sizeof(float) + 7) & ~(size_t)7;
+    }
+    float* values() { return (float*)(this + 1); }
+};
+
+struct TrigBatch
+{
+    World*  world;
+    int64   sendSample;     // sample clock at the time of sending
+    bool    timestamps;     // nested bundle per trigger
+    uint32  numEvents;
+    uint32  size;           // bytes
+    uint32  capacity;       // bytes
+
+    char* events() { return (char*)(this + 1); }
+};
+
+enum {
+    kSharedBatchSize = 16384,   // bytes of events
+    kMaxPacketSize = 8192       // bytes per bundle
+};
+
+// settings of /cmd sendTrigN
+struct SendTrigNConfig
+{
+    float   maxRate;        // triggers per second and unit, 0 for no limit
+    bool    shared;         // one batch for all units
+    bool    timestamps;     // timestamp every trigger
+};
+
+static SendTrigNConfig gConfig = { 0.f, false, false };
+
+// batch shared by all units
+static struct
+{
+    TrigBatch*  batch;
+    int         bufCounter;     // control period of the events
+    int         numUnits;
+} gShared = { 0, 0, 0 };
+
+static TrigBatch* TrigBatch_alloc(World* world, size_t capacity)
+{
+    TrigBatch* batch = (TrigBatch*)RTAlloc(world, sizeof(TrigBatch) + capacity);
+    if (batch == 0) return 0;
+    batch->world = world;
+    batch->sendSample = 0;
+    batch->timestamps = false;
+    batch->numEvents = 0;
+    batch->size = 0;
+    batch->capacity = capacity;
+    return batch;
+}
+
+// return false if the batch is full
+static bool TrigBatch_add(TrigBatch* batch, int32 nodeID, int32 id, int64 sample,
+                          size_t numValues, const float* values)
+{
+    const size_t size = TrigEvent::size(numValues);
+    if (batch->size + size > batch->capacity)
+        return false;
+    TrigEvent* event = (TrigEvent*)(batch->events() + batch->size);
+    event->nodeID = nodeID;
+    event->id = id;
+    event->sample = sample;
+    event->numValues = numValues;
+    memcpy(event->values(), values, numValues * sizeof(float));
+    batch->size += size;
+    batch->numEvents++;
+    return true;
+}
+
+// big endian OSC data
+class OSCWriter
+{
+public:
+    OSCWriter(char* data)
+        : m_data(data), m_pos(0)
+    { }
+
+    size_t size() const { return m_pos; }
+    const char* data() const { return m_data; }
+    void reset() { m_pos = 0; }
+
+    void addi(int32 x)
+    {
+        const uint32 u = (uint32)x;
+        m_data[m_pos++] = (char)(u >> 24);
+        m_data[m_pos++] = (char)(u >> 16);
+        m_data[m_pos++] = (char)(u >> 8);
+        m_data[m_pos++] = (char)u;
+    }
+    void addt(uint64 t)
+    {
+        addi((int32)(t >> 32));
+        addi((int32)t);
+    }
+    void addf(float x)
+    {
+        int32 i;
+        memcpy(&i, &x, sizeof(i));
+        addi(i);
+    }
+    void adds(const char* s)
+    {
+        const size_t n = strlen(s) + 1;
+        const size_t padded = (n + 3) & ~(size_t)3;
+        memcpy(m_data + m_pos, s, n);
+        memset(m_data + m_pos + n, 0, padded - n);
+        m_pos += padded;
+    }
+    void addtags(size_t numInts, size_t numFloats)
+    {
+        const size_t n = 1 + numInts + numFloats + 1;
+        const size_t padded = (n + 3) & ~(size_t)3;
+        m_data[m_pos] = ',';
+        memset(m_data + m_pos + 1, 'i', numInts);
+        memset(m_data + m_pos + 1 + numInts, 'f', numFloats);
+        memset(m_data + m_pos + n - 1, 0, padded - n + 1);
+        m_pos += padded;
+    }
+
+    // bundle element: reserve its size and fill it in with endElement
+    size_t beginElement()
+    {
+        const size_t pos = m_pos;
+        addi(0);
+        return pos;
+    }
+    void endElement(size_t pos)
+    {
+        const size_t end = m_pos;
+        m_pos = pos;
+        addi(end - pos - 4);
+        m_pos = end;
+    }
+
+    // size of a /tr message with numValues arguments
+    static size_t messageSize(const char* cmdName, size_t numValues)
+    {
+        const size_t name = (strlen(cmdName) + 4) & ~(size_t)3;
+        const size_t tags = (numValues + 4 + 3) & ~(size_t)3;
+        return name + tags + 4 * (2 + numValues);
+    }
+
+private:
+    char*   m_data;
+    size_t  m_pos;
+};
+
+// OSC time of the system clock
+static uint64 oscTimeNow()
+{
+    const uint64 kSecondsFrom1900To1970 = 2208988800ULL;
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return ((uint64)(tv.tv_sec + kSecondsFrom1900To1970) << 32)
+        + (uint64)(tv.tv_usec * 4294.967296);
+}
+
+static void TrigBatch_sendPacket(World* world, const OSCWriter& packet)
+{
+    HiddenWorld* hw = world->hw;
+    for (uint32 i=0; i < hw->mNumUsers; ++i) {
+        SendReply(hw->mUsers + i, (char*)packet.data(), packet.size());
+    }
+}
+
+static void TrigEvent_write(OSCWriter& packet, const char* cmdName, TrigEvent* e)
+{
+    packet.adds(cmdName);
+    packet.addtags(2, e->numValues);
+    packet.addi(e->nodeID);
+    packet.addi(e->id);
+    for (int32 i=0; i < e->numValues; ++i) {
+        packet.addf(e->values()[i]);
+    }
+}
+
+static void TrigBatch_perform(FifoMsg* msg) // NRT
+{
+    const char* cmdName = "/tr";
+    const uint64 kImmediately = 1;
+    TrigBatch* batch = (TrigBatch*)msg->mData;
+    World* world = batch->world;
+    const uint64 now = oscTimeNow();
+    const double samplesToOSC = 4294967296. / world->mSampleRate;
+
+    // with timestamps the outer bundles have the time of the earliest
+    // trigger, which needn't be the first one in a shared batch
+    int64 first = batch->sendSample;
+    char* event = batch->events();
+    for (uint32 k=0; k < batch->numEvents; ++k, event += TrigEvent::size(((TrigEvent*)event)->numValues)) {
+        first = std::min(first, ((TrigEvent*)event)->sample);
+    }
+    const uint64 firstTime = now - (uint64)((batch->sendSample - first) * samplesToOSC);
+    // nested bundle header and its size
+    const size_t stampSize = batch->timestamps ? 16 + 4 : 0;
+
+    char data[kMaxPacketSize];
+    OSCWriter packet(data);
+    event = batch->events();
+    for (uint32 k=0; k < batch->numEvents; ++k, event += TrigEvent::size(((TrigEvent*)event)->numValues)) {
+        TrigEvent* e = (TrigEvent*)event;
+        const size_t size = 4 + stampSize + OSCWriter::messageSize(cmdName, e->numValues);
+        if (16 + size > kMaxPacketSize) {
+            Print("SendTrigN: too many values (%d)\n", e->numValues);
+            continue;
+        }
+        if (!batch->timestamps && (batch->numEvents == 1)) {
+            // plain message
+            TrigEvent_write(packet, cmdName, e);
+            break;
+        }
+        if ((packet.size() > 0) && (packet.size() + size > kMaxPacketSize)) {
+            TrigBatch_sendPacket(world, packet);
+            packet.reset();
+        }
+        if (packet.size() == 0) {
+            packet.adds("#bundle");
+            packet.addt(batch->timestamps ? firstTime : kImmediately);
+        }
+        const size_t element = packet.beginElement();
+        if (batch->timestamps) {
+            const uint64 time = now - (uint64)((batch->sendSample - e->sample) * samplesToOSC);
+            packet.adds("#bundle");
+            packet.addt(time);
+            const size_t message = packet.beginElement();
+            TrigEvent_write(packet, cmdName, e);
+            packet.endElement(message);
+        } else {
+            TrigEvent_write(packet, cmdName, e);
+        }
+        packet.endElement(element);
+    }
+    if (packet.size() > 0) {
+        TrigBatch_sendPacket(world, packet);
+    }
+}
+
+static void TrigBatch_free(FifoMsg* msg) // RT
+{
+    TrigBatch* batch = (TrigBatch*)msg->mData;
+    RTFree(batch->world, batch);
+}
+
+// hand the batch over to the NRT thread; sendSample is the sample
+// clock at the end of the last control period of the events
+static void TrigBatch_send(World* world, TrigBatch* batch, int64 sendSample)
+{
+    batch->sendSample = sendSample;
+    batch->timestamps = gConfig.timestamps;
+    FifoMsg msg;
+    msg.Set(world, TrigBatch_perform, TrigBatch_free, batch);
+    SendMsgFromRT(world, msg);
+}
+
+static void SharedBatch_flush(World* world)
+{
+    if (gShared.batch && (gShared.batch->numEvents > 0)) {
+        TrigBatch_send(world, gShared.batch, (int64)(gShared.bufCounter + 1) * world->mBufLength);
+        gShared.batch = 0;
+    }
+}
+
+// =====================================================================
+// SendTrigN
+//
+// Triggers of a control period are sent as one bundle, or with
+// /cmd sendTrigN shared, the triggers of all units. A single trigger
+// is sent as a plain /tr message unless timestamps are enabled.
+
 struct SendTrigN : public Unit
 {
 	float m_prevtrig;
     float* m_values;
-    
+    TrigBatch* m_batch;     // triggers of the current control period
+    int64 m_lastTrig;       // sample clock of the last trigger sent
+
     inline size_t valueOffset() const { return 2; }
     inline size_t numValues() const { return mNumInputs - valueOffset(); }
+    // at most one trigger per two samples
+    inline size_t batchSize() const { return ((mBufLength + 1) / 2) * TrigEvent::size(numValues()); }
 };
 
 extern "C"
@@ -41,6 +343,7 @@ extern "C"
 	void load(InterfaceTable *inTable);
     void SendTrigN_Ctor(SendTrigN *unit);
     void SendTrigN_next(SendTrigN *unit, int inNumSamples);
+    void SendTrigN_Dtor(SendTrigN *unit);
 };
 
 void SendTrigN_Ctor(SendTrigN *unit)
@@ -48,39 +351,120 @@ void SendTrigN_Ctor(SendTrigN *unit)
 	SETCALC(SendTrigN_next);
 	unit->m_prevtrig = 0.f;
     unit->m_values = (float*)RTAlloc(unit->mWorld, unit->numValues()*sizeof(float));
+    unit->m_batch = TrigBatch_alloc(unit->mWorld, unit->batchSize());
+    unit->m_lastTrig = -((int64)1 << 62);
+    gShared.numUnits++;
 }
 
-void SendTrigN_next(SendTrigN *unit, int inNumSamples)
+void SendTrigN_Dtor(SendTrigN *unit)
 {
-    const char* cmdName = "/tr";
+    World* world = unit->mWorld;
+    RTFree(world, unit->m_values);
+    if (unit->m_batch) RTFree(world, unit->m_batch);
+    if (--gShared.numUnits == 0) {
+        SharedBatch_flush(world);
+        if (gShared.batch) {
+            RTFree(world, gShared.batch);
+            gShared.batch = 0;
+        }
+    }
+}
+
+// add a trigger to the batch of the unit or the shared batch
+static void SendTrigN_add(SendTrigN* unit, int64 sample, int64 sendSample)
+{
+    World* world = unit->mWorld;
+    const size_t numValues = unit->numValues();
+    const int32 nodeID = unit->mParent->mNode.mID;
+    const int32 id = (int32)ZIN0(1);
+    for (size_t i=0; i < numValues; ++i) {
+        unit->m_values[i] = ZIN0(unit->valueOffset()+i);
+    }
+
+    if (!gConfig.shared) {
+        // large enough for a control period
+        if (unit->m_batch)
+            TrigBatch_add(unit->m_batch, nodeID, id, sample, numValues, unit->m_values);
+        return;
+    }
+
+    if (gShared.batch && TrigBatch_add(gShared.batch, nodeID, id, sample, numValues, unit->m_values))
+        return;
+    if (gShared.batch) {
+        // full
+        TrigBatch_send(world, gShared.batch, sendSample);
+    }
+    gShared.batch = TrigBatch_alloc(world, std::max((size_t)kSharedBatchSize, TrigEvent::size(numValues)));
+    if (gShared.batch)
+        TrigBatch_add(gShared.batch, nodeID, id, sample, numValues, unit->m_values);
+}
 
+void SendTrigN_next(SendTrigN *unit, int inNumSamples)
+{
+    World* world = unit->mWorld;
     float *trig = ZIN(0);
     float prevtrig = unit->m_prevtrig;
+    const int64 blockSample = (int64)world->mBufCounter * world->mBufLength;
+    const double minInterval = gConfig.maxRate > 0.f ? world->mSampleRate / gConfig.maxRate : 0.;
+
+    // the shared batch holds the triggers of an earlier control period
+    if (gShared.batch && (gShared.bufCounter != world->mBufCounter)) {
+        SharedBatch_flush(world);
+    }
+    gShared.bufCounter = world->mBufCounter;
+
+    if (unit->m_batch == 0) {
+        unit->m_batch = TrigBatch_alloc(world, unit->batchSize());
+    }
 
     if (unit->m_values == 0)
         return;
-    
-    LOOP(inNumSamples, 
+
+    for (int i=0; i < inNumSamples; ++i) {
         float curtrig = ZXP(trig);
         if (curtrig > 0.f && prevtrig <= 0.f) {
-            for (size_t i=0; i < unit->numValues(); ++i) {
-                unit->m_values[i] = ZIN0(unit->valueOffset()+i);
+            const int64 sample = blockSample + i;
+            if (sample - unit->m_lastTrig >= minInterval) {
+                SendTrigN_add(unit, sample, blockSample + world->mBufLength);
+                unit->m_lastTrig = sample;
             }
-            SendNodeReply(
-                &unit->mParent->mNode,
-                (int)ZIN0(1),
-                cmdName,
-                unit->numValues(),
-                unit->m_values);
         }
         prevtrig = curtrig;
-    );
+    }
     unit->m_prevtrig = prevtrig;
+
+    if (unit->m_batch && (unit->m_batch->numEvents > 0)) {
+        TrigBatch_send(world, unit->m_batch, blockSample + world->mBufLength);
+        unit->m_batch = TrigBatch_alloc(world, unit->batchSize());
+    }
+}
+
+// =====================================================================
+// sendTrigN plugin command
+//
+// /cmd sendTrigN <maxRate> <shared> <timestamps>: limit each SendTrigN
+// to maxRate triggers per second (0: no limit, the default); with
+// shared != 0 the triggers of all SendTrigN units in a control period
+// are sent in one bundle; with timestamps != 0 every /tr message is
+// wrapped in a bundle with the time of its trigger. Timestamps are off
+// by default, since older clients (e.g. OSCresponder in SuperCollider
+// 3.4) don't unpack nested bundles.
+
+static void SendTrigN_cmd(World* world, void* userData, struct sc_msg_iter* args, void* replyAddr)
+{
+    gConfig.maxRate = args->getf(0.f);
+    if (gConfig.maxRate < 0.f) gConfig.maxRate = 0.f;
+    gConfig.shared = args->geti(0) != 0;
+    gConfig.timestamps = args->geti(0) != 0;
+    if (!gConfig.shared) {
+        SharedBatch_flush(world);
+    }
 }
 
 void load(InterfaceTable *inTable)
 {
 	ft = inTable;
 
-	DefineSimpleUnit(SendTrigN);
+	DefineDtorUnit(SendTrigN);
+    DefinePlugInCmd("sendTrigN", SendTrigN_cmd, 0);
 }
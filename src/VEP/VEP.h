@@ -26,6 +26,13 @@
 
 #include <stdexcept>
 #include <sys/time.h>
+#include <time.h>
+
+#if defined(SC_LINUX)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
 
 namespace VEP
 {
@@ -66,6 +73,24 @@ namespace VEP
 //     Clear(n, ptr);
 //   }
 
+  // ===================================================================
+  // Shared state between the RT thread and worker threads
+  //
+  // Loads and stores with a full memory barrier, for counters that
+  // publish data written by another thread.
+
+  template <class T> inline T atomicLoad(const volatile T& x)
+  {
+    T y = x;
+    __sync_synchronize();
+    return y;
+  }
+  template <class T> inline void atomicStore(volatile T& x, T y)
+  {
+    __sync_synchronize();
+    x = y;
+  }
+
   // ===================================================================
   // Printing
 
@@ -124,10 +149,10 @@ namespace VEP
     void wait()
     {
       pthread_mutex_lock(&m_mutex);
-      if (m_count > 0) {
+      while (m_count == 0) {
         pthread_cond_wait(&m_cond, &m_mutex);
-        m_count--;
       }
+      m_count--;
       pthread_mutex_unlock(&m_mutex);
     }
     void signal()
@@ -154,22 +179,123 @@ namespace VEP
   public:
     static double time()
     {
+#if defined(SC_LINUX)
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
       struct timeval tv;
       gettimeofday(&tv, 0);
       return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#endif
     }
 
   public:
     Timer() { reset(); }
 
     void reset() { m_start = time(); }
-    double start() const { m_start; }
+    double start() const { return m_start; }
     double delta() const { return time() - m_start; }
 
   private:
     double m_start;
   };
 
+  // =====================================================================
+  // VEP::EventCount
+  //
+  // Thread signalling without lost wakeups. signal() is wait-free and
+  // only enters the kernel when a thread is actually waiting, so it can
+  // be called from the RT thread. Waiters follow the protocol
+  //
+  //   key = prepareWait();
+  //   if (condition) cancelWait(); else wait(key, timeout);
+  //
+  // On Linux waiting is implemented with a futex on the epoch counter,
+  // elsewhere with a pthread condition variable.
+
+  class EventCount
+  {
+  public:
+    EventCount()
+      : m_epoch(0),
+        m_waiters(0),
+        m_signalTime(0.)
+    {
+#if !defined(SC_LINUX)
+      pthread_mutex_init(&m_mutex, 0);
+      pthread_cond_init(&m_cond, 0);
+#endif
+    }
+    ~EventCount()
+    {
+#if !defined(SC_LINUX)
+      pthread_mutex_destroy(&m_mutex);
+      pthread_cond_destroy(&m_cond);
+#endif
+    }
+
+    int prepareWait()
+    {
+      __sync_fetch_and_add(&m_waiters, 1);
+      return atomicLoad(m_epoch);
+    }
+    void cancelWait()
+    {
+      __sync_fetch_and_sub(&m_waiters, 1);
+    }
+    // return true if woken by signal()
+    bool wait(int key, double seconds)
+    {
+      struct timespec ts;
+      ts.tv_sec = (time_t)seconds;
+      ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+#if defined(SC_LINUX)
+      syscall(SYS_futex, &m_epoch, FUTEX_WAIT_PRIVATE, key, &ts, 0, 0);
+#else
+      struct timeval tv;
+      gettimeofday(&tv, 0);
+      ts.tv_sec += tv.tv_sec;
+      ts.tv_nsec += tv.tv_usec * 1000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&m_mutex);
+      if (atomicLoad(m_epoch) == key)
+        pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+      pthread_mutex_unlock(&m_mutex);
+#endif
+      __sync_fetch_and_sub(&m_waiters, 1);
+      return atomicLoad(m_epoch) != key;
+    }
+    void signal()
+    {
+      __sync_fetch_and_add(&m_epoch, 1);
+      if (atomicLoad(m_waiters) > 0) {
+        m_signalTime = Timer::time();
+#if defined(SC_LINUX)
+        syscall(SYS_futex, &m_epoch, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+#else
+        pthread_mutex_lock(&m_mutex);
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+#endif
+      }
+    }
+    // time of the last signal() that woke a waiter
+    double signalTime() const { return m_signalTime; }
+
+  private:
+    volatile int    m_epoch;
+    volatile int    m_waiters;
+    volatile double m_signalTime;
+#if !defined(SC_LINUX)
+    pthread_mutex_t m_mutex;
+    pthread_cond_t  m_cond;
+#endif
+  };
+  
   // ===================================================================
   // Benchmark
   //
@@ -2,6 +2,7 @@
 #define VEP_BUFFER_H_INCLUDED
 
 #include "VEPFFT.h"
+#include <algorithm>
 #include <vector>
 
 namespace VEP
@@ -37,6 +38,14 @@ namespace VEP
   
     const T* operator[](size_t i) const { return m_data[i]; }
     T* operator[](size_t i) { return m_data[i]; }
+    // channel pointers
+    T* const* channels() const { return &m_data[0]; }
+    // exchange the contents with other (doesn't allocate)
+    void swap(Buffer& other)
+    {
+      std::swap(m_numFrames, other.m_numFrames);
+      m_data.swap(other.m_data);
+    }
 
     const_iterator begin() const { return m_data.begin(); }
     const_iterator end() const { return m_data.end(); }
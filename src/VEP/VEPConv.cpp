@@ -19,6 +19,7 @@
 
 #include "VEPConv.h"
 #include "VEPDSP.h"
+#include "VEPTrace.h"
 
 #include "clz.h"
 
@@ -26,8 +27,10 @@
 #include <assert.h>
 #include <algorithm>
 #include <limits>
+#include <math.h>
 #include <sndfile.h>
 #include <string.h>
+#include <unistd.h>
 
 using namespace VEP;
 
@@ -38,18 +41,19 @@ VEP::Response::Response(size_t numChannels, size_t numFrames, size_t minSize, si
   : m_numChannels(numChannels),
     m_numFrames(numFrames),
     m_minPartSize(minSize),
-    m_maxPartSize(std::min(maxSize, (size_t)FFT::kMaxLogSize)),
+    m_maxPartSize(std::min(maxSize, (size_t)1 << FFT::kMaxLogSize)),
     m_size(0),
     m_numPartitions(0)
 {
-  initModules(numFrames, minSize, maxSize);
+  assert( FFT::isValidSize(minSize) );
+  initModules(numFrames, m_minPartSize, m_maxPartSize);
 }
 
 void VEP::Response::printOn(FILE *stream) const
 {
   fprintf(stream, "VEPResponse: modules %d size %d\n", numModules(), m_size);
   for (size_t i = 0; i < numModules(); ++i) {
-    fprintf(stream, "%3d %5d|%5d  %d\n", 1<<i, m_modules[i].offset(), m_modules[i].size(), m_modules[i].count());
+    fprintf(stream, "%3d %5d|%5d  %d\n", m_modules[i].size() / m_minPartSize, m_modules[i].offset(), m_modules[i].size(), m_modules[i].count());
   }
 }
 
@@ -59,26 +63,226 @@ void VEP::Response::initModules(size_t numFrames, size_t minSize, size_t maxSize
   size_t rest = numFrames;
   m_size = 0;
   while (rest > 0) {
-    size_t maxCount = partSize >= maxSize
+    size_t maxCount = 2*partSize > maxSize
       ? std::numeric_limits<size_t>::max() : (numModules() == 0 ? 4 : 2);
-    rest = addModule(m_size, partSize, maxCount, rest);
+    if ((m_size > 0) && ((maxCount == std::numeric_limits<size_t>::max()) || (rest <= partSize * maxCount))) {
+      // last module: pick the partition size with the least padded work
+      rest = addModule(m_size, tailSize(m_size, partSize, rest), std::numeric_limits<size_t>::max(), rest);
+    } else {
+      rest = addModule(m_size, partSize, maxCount, rest);
+    }
     partSize *= 2;
   }
 }
 
+// Estimated cost per output frame of a module with count partitions of
+// size frames: forward and inverse transform of 2*size values and count
+// complex multiply-accumulates of size bins. Mixed radix transforms are
+// a bit slower than power of two transforms of the same size.
+static double moduleCost(size_t size, size_t count)
+{
+  const double n = 2. * size;
+  const size_t factor = FFT::factor(size);
+  const double radixPenalty = factor == 5 ? 1.25 : (factor == 3 ? 1.15 : 1.);
+  return (2. * 2.5 * n * log2(n) * radixPenalty + 8. * size * count) / size;
+}
+
+size_t VEP::Response::tailSize(size_t offset, size_t maxSize, size_t rest) const
+{
+  static const size_t kFactors[] = { 1, 3, 5 };
+
+  size_t bestSize = maxSize;
+  double bestCost = moduleCost(maxSize, rest / maxSize + (rest % maxSize ? 1 : 0));
+
+  for (size_t i = 0; i < sizeof(kFactors)/sizeof(kFactors[0]); ++i) {
+    for (size_t size = kFactors[i] * 4; size < maxSize; size <<= 1) {
+      // partitions must consist of whole bins, the bin count must be
+      // one or even for the two stage schedule and the offset must
+      // leave one partition period for computing the convolution
+      const size_t numBins = size / m_minPartSize;
+      if (((size % m_minPartSize) != 0) || ((numBins > 1) && (numBins & 1))
+          || (2 * size > offset) || !FFT::isValidSize(size))
+        continue;
+      const double cost = moduleCost(size, rest / size + (rest % size ? 1 : 0));
+      if ((cost < bestCost) || ((cost == bestCost) && (size > bestSize))) {
+        bestCost = cost;
+        bestSize = size;
+      }
+    }
+  }
+
+  return bestSize;
+}
+
 size_t VEP::Response::addModule(size_t offset, size_t size, size_t maxCount, size_t rest)
 {
   m_modules.push_back(
     Module(
       offset, size,
       std::min(maxCount, rest / size + (rest % size ? 1 : 0)),
-      FFT::get(LOG2CEIL(size), true)));
+      FFT::get(size, true)));
   const size_t l = size * m_modules.back().count();
   m_size += l;
   m_numPartitions += m_modules.back().count();
   return rest - std::min(rest, l);
 }
 
+// =====================================================================
+// VEP::Kernel
+
+VEP::Kernel::Kernel(size_t numChannels, size_t numPartitions, size_t fftSize, KernelFormat format)
+  : m_refCount(1),
+    m_generation(0),
+    m_format(format),
+    m_numChannels(numChannels),
+    m_numPartitions(numPartitions),
+    m_fftSize(fftSize),
+    m_data(numChannels, format == kKernelFloat32 ? numPartitions * fftSize : 0),
+    m_data16(numChannels, format == kKernelFloat32 ? 0 : numPartitions * fftSize),
+    m_scale(numChannels * numPartitions, 1.f),
+    m_partEnergy(numPartitions, 0.f),
+    m_sparse(numPartitions, 0),
+    m_taps(numChannels * numPartitions * kMaxPartitionTaps),
+    m_numTaps(0),
+    m_tapErrorEnergy(0.),
+    m_errorEnergy(0.),
+    m_energy(0.)
+{
+  m_numReaders[0] = m_numReaders[1] = 0;
+}
+
+unsigned VEP::Kernel::swap(Kernel& other)
+{
+  assert( (other.m_format == m_format) && (other.m_numChannels == m_numChannels)
+          && (other.m_numPartitions == m_numPartitions) && (other.m_fftSize == m_fftSize) );
+  m_data.swap(other.m_data);
+  m_data16.swap(other.m_data16);
+  m_scale.swap(other.m_scale);
+  m_partEnergy.swap(other.m_partEnergy);
+  m_sparse.swap(other.m_sparse);
+  m_taps.swap(other.m_taps);
+  std::swap(m_numTaps, other.m_numTaps);
+  std::swap(m_tapErrorEnergy, other.m_tapErrorEnergy);
+  std::swap(m_errorEnergy, other.m_errorEnergy);
+  std::swap(m_energy, other.m_energy);
+  // readers registering from now on see the new contents
+  const unsigned generation = m_generation;
+  atomicStore(m_generation, generation + 1);
+  return generation;
+}
+
+unsigned VEP::Kernel::beginRead()
+{
+  // register again if the contents were swapped meanwhile
+  for (;;) {
+    const unsigned generation = atomicLoad(m_generation);
+    __sync_add_and_fetch(&m_numReaders[generation & 1], 1);
+    if (atomicLoad(m_generation) == generation) return generation;
+    endRead(generation);
+  }
+}
+
+void VEP::Kernel::clearStats()
+{
+  std::fill(m_partEnergy.begin(), m_partEnergy.end(), 0.f);
+  m_errorEnergy = 0.;
+  m_energy = 0.;
+}
+
+void VEP::Kernel::clearTaps()
+{
+  std::fill(m_sparse.begin(), m_sparse.end(), 0);
+  m_numTaps = 0;
+  m_tapErrorEnergy = 0.;
+}
+
+size_t VEP::Kernel::numSparse() const
+{
+  return std::count(m_sparse.begin(), m_sparse.end(), 1);
+}
+
+void VEP::Kernel::addTap(size_t channel, size_t delay, float gain)
+{
+  assert( m_numTaps < m_taps.size() );
+  Tap& tap = m_taps[m_numTaps++];
+  tap.channel = channel;
+  tap.delay = delay;
+  tap.gain = gain;
+}
+
+// =====================================================================
+// Convolver loops
+//
+// NC and N are the channel count and the size in frames, or 0 if they
+// are only known at run time.
+
+template <size_t NC, size_t N> struct ConvolverLoops
+{
+  static void copy(float* const* dst, const float* const* src, size_t numChannels, size_t n)
+  {
+    for (size_t c=0; c < (NC ? NC : numChannels); ++c)
+      memCopy(dst[c], src[c], N ? N : n);
+  }
+  static void mix(float* const* dst, const float* const* src, size_t numChannels, size_t n)
+  {
+    // NOTE: host buffers aren't necessarily aligned
+    for (size_t c=0; c < (NC ? NC : numChannels); ++c) {
+      float* out = dst[c];
+      const float* in = src[c];
+      for (size_t i=0; i < (N ? N : n); ++i)
+        out[i] += in[i];
+    }
+  }
+  static void cmac(float* const* dst, const float* const* src1, const float* const* src2, size_t numChannels, size_t n)
+  {
+    for (size_t c=0; c < (NC ? NC : numChannels); ++c)
+      DSP::cmac_hc(dst[c], src1[c], src2[c], 2 * (N ? N : n));
+  }
+  static void overlapAdd(float* const* dst, const float* const* src, float* const* overlap, size_t numChannels, size_t n)
+  {
+    const size_t size = N ? N : n;
+    for (size_t c=0; c < (NC ? NC : numChannels); ++c) {
+      float* out = dst[c];
+      const float* in = src[c];
+      float* prev = overlap[c];
+      for (size_t i=0; i < size; ++i)
+        out[i] = in[i] + prev[i];
+      memCopy(prev, in + size, size);
+    }
+  }
+  static Convolver::Loops get()
+  {
+    Convolver::Loops loops;
+    loops.copy = copy;
+    loops.mix = mix;
+    loops.cmac = cmac;
+    loops.overlapAdd = overlapAdd;
+    loops.size = N;
+    return loops;
+  }
+};
+
+template <size_t NC> static Convolver::Loops convolverLoops(size_t size)
+{
+  switch (size) {
+    case 64:  return ConvolverLoops<NC,64>::get();
+    case 128: return ConvolverLoops<NC,128>::get();
+    case 256: return ConvolverLoops<NC,256>::get();
+  }
+  return ConvolverLoops<NC,0>::get();
+}
+
+Convolver::Loops Convolver::loops(size_t numChannels, size_t size)
+{
+  switch (numChannels) {
+    case 1: return convolverLoops<1>(size);
+    case 2: return convolverLoops<2>(size);
+    case 4: return convolverLoops<4>(size);
+    case 8: return convolverLoops<8>(size);
+  }
+  return ConvolverLoops<0,0>::get();
+}
+
 // =====================================================================
 // Convolver
 
@@ -86,7 +290,9 @@ Convolver::Convolver(
   size_t numChannels,
   size_t binSize,
   const Response::Module& module,
-  size_t externalDelay
+  KernelFormat kernelFormat,
+  Kernel* kernel,
+  size_t slack
   )
 : m_numChannels(numChannels),
   m_binSize(binSize),
@@ -94,46 +300,91 @@ Convolver::Convolver(
   m_stage(0),
   m_binIndex(0),
   m_inputSpecPos(0),
-  m_inputBuffer(m_numChannels, partitionSize() * 4),  // [ work ] [ pad ] [ fill ] [ pad ]
+  // [ work ] [ pad ] ... [ fill ] [ pad ] [ free ] [ pad ]; the free
+  // partition keeps a full buffer from looking empty
+  m_inputBuffer(m_numChannels, (slack + 2) * fft()->paddedSize()),
   m_inputSpecBuffer(m_numChannels, numPartitions() * fft()->paddedSize()),
   m_outputBuffer(m_numChannels, irOffset() + partitionSize()),
-  m_irBuffer(m_numChannels, numPartitions() * fft()->paddedSize()),
+  m_kernel(kernel ? kernel : new Kernel(m_numChannels, numPartitions(), fft()->paddedSize(), kernelFormat)),
   m_fftMACBuffer(m_numChannels, fft()->paddedSize()),
   m_overlapBuffer(m_numChannels, partitionSize()),
-  m_fftBuffer(m_numChannels, fft()->paddedSize())
+  m_fftBuffer(m_numChannels, fft()->paddedSize()),
+  m_async(false),
+  m_binCount(0),
+  m_numPushed(0),
+  m_numRequested(0),
+  m_numComputed(0),
+  m_jobStep(0),
+  m_jobGeneration(0),
+  m_jobTime(0.),
+  m_cost(0.),
+  m_dropLate(false),
+  m_dropInput(false),
+  m_slotPartition(slack + 2, (size_t)-1),
+  m_numDropped(0),
+  m_partActive(numPartitions(), 1),
+  m_partGain(numPartitions(), 1.f),
+  m_batched(false),
+  m_batchMark(false),
+  m_stageBin(0),
+  m_binLoops(loops(m_numChannels, binSize)),
+  m_partLoops(loops(m_numChannels, module.size())),
+  m_binPtrs(m_numChannels),
+  m_specPtrs(m_numChannels),
+  m_irPtrs(m_numChannels),
+  m_outPtrs(m_numChannels)
 {
 //   printf("Convolver: numBins %d partitionSize %d numPartitions %d partitionOffset %d irOffset %d\n",
 //       numBins(), partitionSize(), numPartitions(), m_partitionOffset, irOffset());
 
-  assert( (irOffset() % partitionSize()) == 0 );
+  assert( (partitionSize() % m_binSize) == 0 );
+  assert( (irOffset() % m_binSize) == 0 );
+  assert( (m_kernel->numChannels() == m_numChannels) && (m_kernel->numPartitions() == numPartitions()) );
+  assert( m_kernel->format() == kernelFormat );
 
-  // if (irOffset() > 0) {
-  //   // delay input buffer by partition size (plus padding for the fft)
-  //   m_inputBuffer.writeAdvance(partitionSize()*2);
-  //   // pre-delay convolver output for later partitions
-  //   // NOTE: input already delayed by partitionSize
-  //   size_t delay = irOffset() - partitionSize();
-  //   m_outputBuffer.writeAdvance(delay);
-  // }
-  
-  m_outputBuffer.writeAdvance(irOffset() - (partitionSize() - externalDelay) * (irOffset() > 0));
+  if (kernel) kernel->retain();
+
+  // pre-delay convolver output by the IR offset; partition k is written
+  // to the output at k * partitionSize() + irOffset()
+  m_outputBuffer.writeAdvance(irOffset());
+}
+
+Convolver::~Convolver()
+{
+  m_kernel->release();
 }
 
-void Convolver::pushInput(const float** src, size_t numChannels, size_t numFrames)
+bool Convolver::pushInput(const float** src, size_t numChannels, size_t numFrames)
 {
   // printf("pushInput %d wpos=%d wspace=%d size=%d iroff=%d\n", numFrames, m_inputBuffer.writePos(), m_inputBuffer.writeSpace(), m_inputBuffer.size(), irOffset());
 
+  if ((m_binCount % numBins()) == 0) {
+    // a partition starts: discard its input if the worker hasn't freed
+    // a slot for it, instead of waiting
+    m_dropInput = m_dropLate && !hasInputSlot();
+  }
+  if (m_dropInput) {
+    VEP_TRACE_INSTANT("discard", (int)partitionSize());
+    m_numDropped++;
+    return ((m_binCount + 1) % numBins()) == 0;
+  }
+
   assert( numFrames <= binSize() );
   assert( m_inputBuffer.writeSpace() >= binSize() );
   assert( numChannels == m_numChannels );
   
-  for (size_t c=0; c < numChannels; ++c)
-  {
-    float *dst = m_inputBuffer.writeVector(c);
+  if (numFrames == binSize()) {
     // copy input to ringbuffer
-    memCopy(dst, src[c], std::min(binSize(), numFrames));
-    // clear remainder
-    if (numFrames < binSize()) {
+    for (size_t c=0; c < numChannels; ++c)
+      m_binPtrs[c] = m_inputBuffer.writeVector(c);
+    m_binLoops.copy(&m_binPtrs[0], src, numChannels, numFrames);
+  } else {
+    for (size_t c=0; c < numChannels; ++c)
+    {
+      float *dst = m_inputBuffer.writeVector(c);
+      // copy input to ringbuffer
+      memCopy(dst, src[c], numFrames);
+      // clear remainder
       memZero(dst + numFrames, binSize() - numFrames);
     }
   }
@@ -142,12 +393,15 @@ void Convolver::pushInput(const float** src, size_t numChannels, size_t numFrame
 
   // clear second half of time-domain input for forward FFT
   if ((m_inputBuffer.writePos() % partitionSize()) == 0) {
+    m_slotPartition[m_inputBuffer.writePos() / fftSize()] = m_numPushed;
     for (size_t c=0; c < numChannels; ++c)
       memZero(m_inputBuffer.writeVector(c), partitionSize());
     m_inputBuffer.writeAdvance(partitionSize());
+    return true;
   }
 
   // printf("pushInput rpos=%d rspace=%d %d\n", m_inputBuffer.readPos(), m_inputBuffer.readSpace(), m_inputBuffer.size());
+  return false;
 }
 
 void Convolver::pullOutput(float** channelData, size_t numChannels, size_t size)
@@ -156,45 +410,100 @@ void Convolver::pullOutput(float** channelData, size_t numChannels, size_t size)
 
   assert( size <= binSize() );
 
-  // NOTE: m_outputBuffer.readSpace() will return zero, because the
-  // write pointer already has been advanced and equals the read
-  // pointer. that's not a problem, because read and write accesses
-  // only take place interleaved, i.e. by the next time data is
-  // written to the buffer the space made by this routine is used.
+  // NOTE: m_outputBuffer.readSpace() is meaningless here, because the
+  // output of a partition is written ahead of the read pointer by
+  // irOffset() frames. The output buffer is sized so that a partition
+  // never overwrites unread output.
 
-  if (irOffset() == 0) {
-    for (size_t c=0; c < numChannels; ++c)
-    {
-      // first partition: assign
-      float* dst = channelData[c];
-      float* src = m_outputBuffer.readVector(c);
-      for (size_t i=0; i < size; ++i)
-        *dst++ = *src++;
+  if (irOffset() > 0) {
+    const size_t pos = m_binCount * binSize();
+    if ((pos >= irOffset()) && (atomicLoad(m_numComputed) <= (pos - irOffset()) / partitionSize())) {
+      // partition is late: drop output
+      VEP_TRACE_INSTANT("drop", (int)partitionSize());
+      m_numDropped++;
+      m_outputBuffer.readAdvance(binSize());
+      return;
     }
+  }
+
+  for (size_t c=0; c < numChannels; ++c)
+    m_binPtrs[c] = m_outputBuffer.readVector(c);
+  const Loops loops = size == binSize() ? m_binLoops : Convolver::loops(numChannels, 0);
+
+  if (irOffset() == 0) {
+    // first partition: assign
+    loops.copy(channelData, &m_binPtrs[0], numChannels, size);
   } else {
-    for (size_t c=0; c < numChannels; ++c)
-    {
-      // later partition: mix
-      float* dst = channelData[c];
-      float* src = m_outputBuffer.readVector(c);
-      for (size_t i=0; i < size; ++i)
-        *dst++ += *src++;
-    }
+    // later partition: mix
+    loops.mix(channelData, &m_binPtrs[0], numChannels, size);
   }
 
   m_outputBuffer.readAdvance(binSize());
 }
 
+void Convolver::skipBin(size_t binPeriod)
+{
+  // all buffers are still silent, so only the positions change;
+  // complete partitions are computed immediately
+  assert( m_numComputed == m_numPushed );
+
+  m_inputBuffer.writeAdvance(binSize());
+  if ((m_inputBuffer.writePos() % partitionSize()) == 0) {
+    m_inputBuffer.writeAdvance(partitionSize());
+    m_inputBuffer.readAdvance(fftSize());
+    m_inputSpecBuffer.writeAdvance(fftSize());
+    m_outputBuffer.writeAdvance(partitionSize());
+    m_numPushed++;
+    atomicStore(m_numComputed, m_numComputed + 1);
+  }
+  m_outputBuffer.readAdvance(binSize());
+
+  m_binIndex = (m_binIndex + 1) % binPeriod;
+  m_binCount++;
+}
+
+bool Convolver::hasRTJob() const
+{
+  // a complete partition that hasn't been handed to the worker
+  const size_t numComputed = atomicLoad(m_numComputed);
+  return (numComputed < m_numPushed) && (numComputed >= atomicLoad(m_numRequested));
+}
+
+bool Convolver::needsBatchStage(size_t stage, size_t binsPerBlock) const
+{
+  if (stage == 0) {
+    return (m_stage == 0) && hasRTJob();
+  }
+  // the second stage follows half a partition period after the first
+  // one, or earlier if the output would be due before the next block
+  const size_t dueBin = m_numComputed * numBins() + irOffset() / binSize();
+  return (m_stage == 1)
+    && ((m_binCount >= m_stageBin + numBins()/2) || (m_binCount + binsPerBlock > dueBin));
+}
+
 void Convolver::compute(size_t binIndex)
 {
+  // batched partitions are computed by Batch::process
+  if (m_batched) return;
+
   // schedule process if
   //   numStages := 2
   //   period := numBins/numStages
   //   ((binIndex - period/2) % period) = 0
   if (((((int)binIndex - (int)numBins()/4) % std::max<int>(1, (int)numBins()/2)) == 0)) {
 //     printf("%d ", numBins());
+    // only start a partition if there's one for the RT thread
+    if ((m_stage == 0) && !hasRTJob())
+      return;
+    Timer timer;
     computeOneStage(m_stage);
-    m_stage = (m_stage + 1) & 1;
+    m_jobTime += timer.delta();
+    if ((numBins() == 1) || (m_stage == 1)) {
+      finishPartition();
+      m_stage = 0;
+    } else {
+      m_stage = 1;
+    }
   }
 }
 
@@ -226,6 +535,8 @@ void Convolver::computeOneStage(size_t stage)
 
 void Convolver::computeInput()
 {
+  VEP_TRACE_SCOPE("computeInput", (int)partitionSize());
+  VEP_PERF_PROBE(m_perf[kStageInput]);
   // get input and advance read pointer
   // NOTE: input is zero-padded automatically in pushInput
 //   printf("computeInput %d %d\n", m_inputBuffer.readSpace(), m_inputBuffer.size());
@@ -233,54 +544,118 @@ void Convolver::computeInput()
   
   // printf("computeInput rspace=%d fftSize=%d\n", m_inputBuffer.readSpace(), fftSize);
   
-  // assert( m_inputBuffer.readSpace() >= fftSize );
+  // NOTE: partitions are only computed once they are complete
+  assert( m_inputBuffer.readSpace() >= fftSize );
   assert( m_inputSpecBuffer.writeSpace() >= fftSize );
 
-  if (m_inputBuffer.readSpace() >= fftSize) {
-    for (size_t c=0; c < m_inputBuffer.numChannels(); ++c)
-    {
-      float* src = m_inputBuffer.readVector(c);
-      // perform FFT (inplace)
-      fft()->execute_forward_hc(src);
-      // convert from HC
-      float* dst = m_inputSpecBuffer.writeVector(c);
-      FFT::shufflehc(dst, src, fftSize);
-      // clear MAC buffer
-      memZero(m_fftMACBuffer[c], fftSize);
-    }
+  for (size_t c=0; c < m_inputBuffer.numChannels(); ++c)
+  {
+    float* src = m_inputBuffer.readVector(c);
+    // perform FFT (inplace)
+    fft()->execute_forward_hc(src);
+    // convert from HC
+    float* dst = m_inputSpecBuffer.writeVector(c);
+    FFT::shufflehc(dst, src, fftSize);
+    // clear MAC buffer
+    memZero(m_fftMACBuffer[c], fftSize);
+  }
 
-    m_inputBuffer.readAdvance(fftSize);
-  } else {
-    printf("filling ...\n");
-    for (size_t c=0; c < m_inputBuffer.numChannels(); ++c)
-    {
-      // clear spec buffer
-      memZero(m_inputSpecBuffer.writeVector(c), fftSize);
-      // clear MAC buffer
-      memZero(m_fftMACBuffer[c], fftSize);
-    }
-  }  
+  m_inputBuffer.readAdvance(fftSize);
+
+  updateGains();
 
   // save input spec pos for MAC and advance write pointer
   m_inputSpecPos = m_inputSpecBuffer.writePos();
   m_inputSpecBuffer.writeAdvance(fftSize);
 }
 
+void Convolver::computeSilentInput()
+{
+  // the input of the partition has been discarded (see pushInput)
+  const size_t fftSize = fft()->paddedSize();
+  assert( m_inputSpecBuffer.writeSpace() >= fftSize );
+
+  for (size_t c=0; c < numChannels(); ++c)
+  {
+    memZero(m_inputSpecBuffer.writeVector(c), fftSize);
+    memZero(m_fftMACBuffer[c], fftSize);
+  }
+
+  updateGains();
+
+  m_inputSpecPos = m_inputSpecBuffer.writePos();
+  m_inputSpecBuffer.writeAdvance(fftSize);
+}
+
+void Convolver::updateGains()
+{
+  // fade partitions in or out over two partition periods
+  const float kFadeStep = 0.5f;
+  for (size_t i=0; i < numPartitions(); ++i) {
+    if (m_partActive[i]) {
+      m_partGain[i] = std::min(1.f, m_partGain[i] + kFadeStep);
+    } else {
+      m_partGain[i] = std::max(0.f, m_partGain[i] - kFadeStep);
+    }
+  }
+}
+
+inline void Convolver::cmac(float* dst, const float* spec, size_t channel, size_t partition)
+{
+  const size_t fftSize = fft()->paddedSize();
+  switch (m_kernel->format()) {
+    case kKernelFloat32:
+      DSP::cmac_hc(dst, spec, m_kernel->data(channel, partition), fftSize);
+      break;
+    case kKernelFloat16:
+      DSP::cmac_hc_f16(dst, spec, m_kernel->data16(channel, partition),
+                       m_kernel->scale(channel, partition), fftSize);
+      break;
+    case kKernelBFloat16:
+      DSP::cmac_hc_bf16(dst, spec, m_kernel->data16(channel, partition), fftSize);
+      break;
+  }
+}
+
 void Convolver::computeMAC(size_t partition)
 {
+  VEP_TRACE_SCOPE("computeMAC", (int)partitionSize());
+  VEP_PERF_PROBE(m_perf[kStageMAC]);
   // compute complex multiplication per channel and accumulate into m_fftMACBuffer
   const int fftSize       = (int)(fft()->paddedSize());
   const int partOffset    = (int)(partition * fftSize);
   const int specbufSize   = (int)(m_inputSpecBuffer.size());
   const int specbufOffset = (m_inputSpecPos - partOffset + specbufSize) % specbufSize;
+  const float gain        = m_partGain[partition];
 
   // printf("%d %d %%d\n", numBins(), partition, specbufSize, specbufOffset);
 
+  if ((gain == 0.f) || m_kernel->isSparse(partition)) return;
+
+  if ((gain == 1.f) && (kernelFormat() == kKernelFloat32)) {
+    for (size_t c = 0; c < numChannels(); ++c) {
+      m_specPtrs[c] = m_inputSpecBuffer.data(c) + specbufOffset;
+      m_irPtrs[c] = m_kernel->data(c, partition);
+    }
+    m_partLoops.cmac(m_fftMACBuffer.channels(), &m_specPtrs[0], &m_irPtrs[0], numChannels(), partitionSize());
+    return;
+  }
+  
   for (size_t c = 0; c < numChannels(); ++c)
   {
     const float* specbuf = m_inputSpecBuffer.data(c) + specbufOffset;
-    const float* partbuf = m_irBuffer[c] + partOffset;
-    DSP::cmac_hc(m_fftMACBuffer[c], specbuf, partbuf, fftSize);
+    if (gain == 1.f) {
+      cmac(m_fftMACBuffer[c], specbuf, c, partition);
+    } else {
+      // fading: accumulate scaled product (m_fftBuffer is free until computeOutput)
+      float* tmp = m_fftBuffer[c];
+      float* dst = m_fftMACBuffer[c];
+      memZero(tmp, fftSize);
+      cmac(tmp, specbuf, c, partition);
+      for (int i = 0; i < fftSize; ++i) {
+        dst[i] += gain * tmp[i];
+      }
+    }
   }
 }
 
@@ -317,6 +692,8 @@ void Convolver::computeMAC(size_t partition)
 
 void Convolver::computeOutput()
 {
+  VEP_TRACE_SCOPE("computeOutput", (int)partitionSize());
+  VEP_PERF_PROBE(m_perf[kStageOutput]);
   const size_t fftSize = fft()->paddedSize();
   // float* fftbuf = m_fftBuffer[0];
 
@@ -328,8 +705,10 @@ void Convolver::computeOutput()
     fft()->execute_backward_hc(m_fftBuffer[c]);
   }
   
+  // NOTE: the output buffer is sized so that a partition never overwrites
+  // unread output; only split at the end of the buffer.
   size_t nwrite = partitionSize();
-  size_t n = m_outputBuffer.writeSpace();
+  size_t n = m_outputBuffer.size() - m_outputBuffer.writePos();
   
   if (n < nwrite) {
     // chunk
@@ -349,47 +728,212 @@ void Convolver::computeOutput()
       float* out = m_outputBuffer.writeVector(c);
       float* overlap = m_overlapBuffer[c];
       for (size_t i = n; i < nwrite; ++i) {
-        out[i] = fftbuf[i] + overlap[i];
+        out[i-n] = fftbuf[i] + overlap[i];
       }
       // save overlap
       memCopy(overlap, fftbuf+nwrite, nwrite);
     }    
     m_outputBuffer.writeAdvance(nwrite-n);
   } else {
+    // add and save overlap
     for (size_t c = 0; c < numChannels(); ++c)
-    {
-      float* fftbuf = m_fftBuffer[c];      
-      float* out = m_outputBuffer.writeVector(c);
-      float* overlap = m_overlapBuffer[c];
-      for (size_t i = 0; i < nwrite; ++i) {
-        out[i] = fftbuf[i] + overlap[i];
-      }
-      // save overlap
-      memCopy(overlap, fftbuf+nwrite, nwrite);
-    }
+      m_outPtrs[c] = m_outputBuffer.writeVector(c);
+    m_partLoops.overlapAdd(&m_outPtrs[0], m_fftBuffer.channels(), m_overlapBuffer.channels(), numChannels(), nwrite);
     // advance output buffer write pointer
     m_outputBuffer.writeAdvance(nwrite);
   }
 }
 
+void VEP::Convolver::finishPartition(bool skipped)
+{
+  // average partition cost
+  if (!skipped) {
+    m_cost = m_cost > 0. ? m_cost * 0.9 + m_jobTime * 0.1 : m_jobTime;
+  }
+  m_jobTime = 0.;
+  // publish output
+  atomicStore(m_numComputed, m_numComputed + 1);
+}
+
+bool VEP::Convolver::isLate(size_t slack) const
+{
+  // partition k is due at bin k * numBins() + irOffset()/binSize(),
+  // which is never earlier than (k + 2) * numBins()
+  const size_t numDue = m_binCount / numBins();
+  if (numDue <= slack) return false;
+  return atomicLoad(m_numComputed) < std::min(atomicLoad(m_numRequested), numDue - slack);
+}
+
+bool VEP::Convolver::isPastDue() const
+{
+  // true if the output of the next partition has been dropped completely
+  const size_t k = m_numComputed;
+  return atomicLoad(m_binCount) >= (k + 1) * numBins() + irOffset() / binSize();
+}
+
+bool VEP::Convolver::hasInputSlot() const
+{
+  // the partition to be filled and the free partition behind it must
+  // not reach the oldest input the worker hasn't read yet
+  const size_t size = m_inputBuffer.size();
+  const size_t distance = (m_inputBuffer.readPos() + size - m_inputBuffer.writePos()) % size;
+  return (distance == 0) || (distance > fftSize());
+}
+
+bool VEP::Convolver::hasInput() const
+{
+  // the oldest unread slot holds the next partition unless its input
+  // has been discarded; a slot is tagged when its partition is complete
+  if (m_inputBuffer.readSpace() == 0) return false;
+  return m_slotPartition[m_inputBuffer.readPos() / fftSize()] == m_numComputed;
+}
+
+bool VEP::Convolver::computeJobStep()
+{
+  assert( hasPendingJob() );
+
+  Timer timer;
+  
+  if (m_jobStep == 0) {
+    // keep the kernel contents alive until the partition is done
+    m_jobGeneration = m_kernel->beginRead();
+    if (hasInput()) {
+      computeInput();
+    } else {
+      computeSilentInput();
+    }
+    if (m_dropLate && isPastDue()) {
+      // skip the partition, but keep its spectrum for later partitions
+      VEP_TRACE_INSTANT("skip", (int)partitionSize());
+      for (size_t c = 0; c < numChannels(); ++c)
+        memZero(m_overlapBuffer[c], partitionSize());
+      m_outputBuffer.writeAdvance(partitionSize());
+      m_kernel->endRead(m_jobGeneration);
+      finishPartition(true);
+      return true;
+    }
+  } else if (m_jobStep <= numPartitions()) {
+    computeMAC(m_jobStep - 1);
+  } else {
+    computeOutput();
+  }
+
+  m_jobTime += timer.delta();
+  
+  if (++m_jobStep == numPartitions() + 2) {
+    m_jobStep = 0;
+    m_kernel->endRead(m_jobGeneration);
+    finishPartition();
+    return true;
+  }
+  
+  return false;
+}
+
 void VEP::Convolver::process(float** dst, const float** src, size_t numChannels, size_t numFrames, size_t binPeriod)
 {
-  pushInput(src, numChannels, numFrames);
+  if (pushInput(src, numChannels, numFrames)) {
+    const size_t k = m_numPushed++;
+    // hand the partition to the worker in asynchronous mode, if the
+    // worker still has to catch up or if its input has been discarded;
+    // partitions are computed in order
+    if (m_async || m_dropInput || (atomicLoad(m_numComputed) < atomicLoad(m_numRequested))) {
+      if (m_stage == 1) {
+        // a batched partition may still be in progress; finish it
+        // before the worker starts the next one
+        for (size_t i=numPartitions()/2; i < numPartitions(); ++i) {
+          computeMAC(i);
+        }
+        computeOutput();
+        finishPartition();
+        m_stage = 0;
+      }
+      atomicStore(m_numRequested, k + 1);
+      VEP_TRACE_INSTANT("request", (int)partitionSize());
+    }
+  }
   compute(m_binIndex);
   pullOutput(dst, numChannels, numFrames);
-  m_binIndex = (m_binIndex + 1) & binPeriod;
+  m_binIndex = (m_binIndex + 1) % binPeriod;
+  m_binCount++;
+}
+
+// gain of IR frame i faded out over fadeLength frames from fadeStart
+static inline float fadeGain(size_t i, size_t fadeStart, size_t fadeLength)
+{
+  if (i < fadeStart) return 1.f;
+  if (i >= fadeStart + fadeLength) return 0.f;
+  return (float)(0.5 * (1. + cos(M_PI * (i - fadeStart) / fadeLength)));
+}
+
+void VEP::Convolver::findTaps(Kernel* kernel, const float* srcBuffer, size_t srcNumChannels, size_t srcNumFrames,
+                              size_t maxTapDelay, float threshold, size_t fadeStart, size_t fadeLength) const
+{
+  // silent partitions are skipped anywhere, partitions with a few taps
+  // per channel only within maxTapDelay frames; samples not above the
+  // threshold count as silent and are left out
+  const size_t minNumChannels = std::min(numChannels(), srcNumChannels);
+
+  kernel->clearTaps();
+
+  for (size_t pi=0; pi < numPartitions(); ++pi)
+  {
+    const size_t begin = std::min(srcNumFrames, irOffset() + pi * partitionSize());
+    const size_t end = std::min(srcNumFrames, irOffset() + (pi + 1) * partitionSize());
+    size_t maxTaps = 0;
+    for (size_t c=0; c < minNumChannels; ++c) {
+      size_t n = 0;
+      for (size_t i=begin; i < end; ++i) {
+        if (fabsf(srcBuffer[i * srcNumChannels + c]) > threshold) n++;
+      }
+      maxTaps = std::max(maxTaps, n);
+    }
+    if ((maxTaps > 0)
+        && ((maxTaps > Kernel::kMaxPartitionTaps) || (irOffset() + (pi + 1) * partitionSize() > maxTapDelay)))
+      continue;
+    kernel->setSparse(pi);
+    double errorEnergy = 0.;
+    for (size_t c=0; c < minNumChannels; ++c) {
+      for (size_t i=begin; i < end; ++i) {
+        const float y = srcBuffer[i * srcNumChannels + c];
+        const float x = y * fadeGain(i, fadeStart, fadeLength);
+        if (fabsf(y) <= threshold) {
+          errorEnergy += (double)x * x;
+        } else if (x != 0.f) {
+          kernel->addTap(c, i, x);
+        }
+      }
+    }
+    kernel->addTapError(errorEnergy);
+  }
 }
 
-void VEP::Convolver::setKernel(const float* srcBuffer, size_t srcNumChannels, size_t srcNumFrames)
+VEP::Kernel* VEP::Convolver::newKernel() const
+{
+  return new Kernel(m_numChannels, numPartitions(), fftSize(), kernelFormat());
+}
+
+void VEP::Convolver::transformKernel(Kernel* kernel, const float* srcBuffer, size_t srcNumChannels, size_t srcNumFrames,
+                                     size_t maxTapDelay, float threshold, size_t fadeStart, size_t fadeLength) const
 {
   const size_t minNumChannels = std::min(numChannels(), srcNumChannels);
+
+  // frames past the fade are silent
+  srcNumFrames = std::min(srcNumFrames, fadeStart + fadeLength);
+
+  findTaps(kernel, srcBuffer, srcNumChannels, srcNumFrames, maxTapDelay, threshold, fadeStart, fadeLength);
   
   const size_t fftSize = fft()->paddedSize();
 	const double norm = fft()->norm(); // normalize by 1/N
 
+  // own scratch buffers, the convolver's are used by the processing
+  AudioBuffer fftBuffer(1, fftSize);
+  AudioBuffer specBuffer(1, kernelFormat() == kKernelFloat32 ? 0 : fftSize);
+
+  kernel->clearStats();
+
 	for (size_t c = 0; c < minNumChannels; ++c)
 	{
-    float* dst = m_irBuffer[c];
 		const float* src = srcBuffer + (irOffset() * srcNumChannels) + c;
 		size_t rest = std::min(
 		  srcNumFrames - std::min(srcNumFrames, irOffset()),  // src frames - offset
@@ -400,10 +944,13 @@ void VEP::Convolver::setKernel(const float* srcBuffer, size_t srcNumChannels, si
 		{
 			// deinterleave channel c into fftbuf and pad
       size_t n = std::min(partitionSize(), rest);
-      float* fftbuf = m_fftBuffer[0];
+      float* fftbuf = fftBuffer[0];
+      const size_t frame = irOffset() + pi * partitionSize();
 			for (size_t i = 0; i < n; ++i)
 			{
-				fftbuf[i] = *src * norm;
+        const float x = *src * fadeGain(frame + i, fadeStart, fadeLength);
+        kernel->partitionEnergy(pi) += x * x;
+				fftbuf[i] = x * norm;
         src += srcNumChannels;
 			}
 			memZero(fftbuf+n, fftSize-n);
@@ -411,54 +958,188 @@ void VEP::Convolver::setKernel(const float* srcBuffer, size_t srcNumChannels, si
 			// transform partition
 			fft()->execute_forward_hc(fftbuf);
 			// convert from HC
-			FFT::shufflehc(dst, fftbuf, fftSize);
+      if (kernelFormat() == kKernelFloat32) {
+  			FFT::shufflehc(kernel->data(c, pi), fftbuf, fftSize);
+      } else {
+        float* spec = specBuffer[0];
+        FFT::shufflehc(spec, fftbuf, fftSize);
+        packKernel(kernel, kernel->data16(c, pi), &kernel->scale(c, pi), spec, fftSize);
+      }
 
-			dst += fftSize;
 			rest -= n;
 		}
 	}
 	
   for (size_t c = minNumChannels; c < numChannels(); ++c)
   {
-    memZero(m_irBuffer[c], fftSize * numPartitions());
+    if (kernelFormat() == kKernelFloat32) {
+      memZero(kernel->data(c, 0), fftSize * numPartitions());
+    } else {
+      memZero(kernel->data16(c, 0), fftSize * numPartitions());
+    }
+  }
+}
+
+double VEP::Convolver::irEnergy() const
+{
+  double energy = 0.;
+  for (size_t i=0; i < numPartitions(); ++i)
+    energy += partitionEnergy(i);
+  return energy;
+}
+
+void VEP::Convolver::packKernel(Kernel* kernel, uint16_t* dst, float* scale, const float* src, size_t n) const
+{
+  // convert partition spectrum and measure the conversion error
+  double errorEnergy = 0., energy = 0.;
+  if (kernelFormat() == kKernelFloat16) {
+    // scale maximum magnitude to 2^15, well below the largest half
+    // precision value
+    float maxAbs = 0.f;
+    for (size_t i=0; i < n; ++i)
+      maxAbs = std::max(maxAbs, fabsf(src[i]));
+    *scale = maxAbs > 0.f ? maxAbs / 32768.f : 1.f;
+    const float invScale = 1.f / *scale;
+    for (size_t i=0; i < n; ++i) {
+      dst[i] = DSP::float_to_half(src[i] * invScale);
+      const double e = (double)DSP::half_to_float(dst[i]) * *scale - src[i];
+      errorEnergy += e * e;
+      energy += (double)src[i] * src[i];
+    }
+  } else {
+    *scale = 1.f;
+    for (size_t i=0; i < n; ++i) {
+      dst[i] = DSP::float_to_bfloat16(src[i]);
+      const double e = (double)DSP::bfloat16_to_float(dst[i]) - src[i];
+      errorEnergy += e * e;
+      energy += (double)src[i] * src[i];
+    }
   }
+  kernel->addStats(errorEnergy, energy);
 }
 
 // =====================================================================
 // VEP::Convolution
 
-VEP::Convolution::Convolution(const Response& response, size_t numRTProcs)
+static size_t gcd(size_t a, size_t b)
+{
+  while (b != 0) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// latency needed to re-block host blocks of blockSize frames into bins
+// of binSize frames
+static size_t reblockLatency(size_t blockSize, size_t binSize)
+{
+  return binSize - gcd(blockSize, binSize);
+}
+
+VEP::Convolution::Convolution(const Response& response, size_t blockSize, double sampleRate, const Options& options)
 	: m_response(response),
-    m_numRTProcs(numRTProcs == 0 ? response.numModules() : numRTProcs),
-		m_process(0)
+    m_blockSize(blockSize),
+    m_sampleRate(sampleRate),
+    m_latency(reblockLatency(blockSize, response.minPartSize())),
+    m_reblock((blockSize % response.minPartSize()) != 0),
+    m_reblockInput(response.numChannels(), m_reblock ? response.minPartSize() : 0),
+    m_reblockOutput(response.numChannels(), m_reblock ? response.minPartSize() : 0),
+    m_reblockFifo(response.numChannels(), m_reblock ? m_latency + blockSize + response.minPartSize() : 0),
+    m_reblockFill(0),
+    m_srcChannelData(response.numChannels()),
+    m_dstChannelData(response.numChannels()),
+    m_tapDelay(std::min((size_t)kMaxTapDelay, response.size()) / response.minPartSize() * response.minPartSize()),
+    m_tapHistory(response.numChannels(), 2 * (m_tapDelay + response.minPartSize())),
+    m_tapPos(0),
+    m_sparseThreshold((float)pow(10., options.sparseThreshold / 20.)),
+    m_tailCutoff(options.batch ? 0 : options.tailCutoff),
+    m_tailActive(false),
+    m_adaptive(options.numRTProcs < 0),
+    m_maxRTLoad(options.maxRTLoad),
+    m_rtLoad(0.),
+    m_waitTime(0.),
+    m_holdOff(0),
+    m_overloadPolicy(options.overloadPolicy),
+    m_numShed(0),
+    m_shedHoldOff(0),
+    m_calmFrames(0),
+    m_overloaded(false),
+		m_process(0),
+    m_batchNext(0)
 {
   size_t binSize = response.minPartSize();
 
-  size_t delay = 0;
-	if (response.numModules() > m_numRTProcs) {
-	  const Response::Module& module = response[m_numRTProcs];
-    delay = module.offset();
+  // pre-delay re-blocking output
+  if (m_reblock) {
+    m_reblockFifo.writeAdvance(m_latency);
   }
 
-  // initialize convolvers
-  for (size_t i=0; i < response.numModules(); ++i) {
+  assert( !options.batch || ((options.batch->kernelFormat() == options.kernelFormat)
+                              && (options.batch->blockSize() == blockSize)
+                              && (options.batch->response().numModules() == response.numModules())) );
+
+  // the tail is rendered by one network per channel, delayed to the
+  // cutoff
+  if (m_tailCutoff > 0) {
+    for (size_t c=0; c < response.numChannels(); ++c) {
+      m_tails.push_back(new FDN(sampleRate, m_tailCutoff));
+    }
+  }
+
+  // modules without enough slack always run in the RT thread
+  const size_t numModules = response.numModules();
+  m_minSplit = 0;
+  for (size_t i=0; i < numModules; ++i) {
+    if (!Convolver::canBeAsync(response[i])) m_minSplit = i + 1;
+  }
+
+  // adaptive mode starts with as much work in the worker as possible and
+  // moves modules to the RT thread while there is headroom
+  if (m_adaptive) {
+    m_split = m_minSplit;
+  } else if (options.numRTProcs == 0) {
+    m_split = numModules;
+  } else {
+    m_split = std::max(m_minSplit, std::min((size_t)options.numRTProcs, numModules));
+  }
+
+  // initialize convolvers; the input FIFO of a module that may be
+  // computed by the worker holds the partitions the RT thread lets it
+  // fall behind (see processBin)
+  const size_t asyncSlack = m_overloadPolicy == kOverloadWait ? 1 : 2;
+  for (size_t i=0; i < numModules; ++i) {
+   const bool mayBeAsync = i >= (m_adaptive ? m_minSplit : m_split);
    m_convs.push_back(
      new Convolver(
        response.numChannels(),
        binSize,
        response[i],
-       i >= m_numRTProcs ? response[m_numRTProcs].offset() : 0));
+       options.kernelFormat,
+       options.batch ? options.batch->kernel(i) : 0,
+       mayBeAsync ? asyncSlack : 0));
+   m_convs.back()->setBatched(options.batch && options.batch->isBatched(i));
   }
 	
-	m_binPeriod = m_convs.back()->numBins() - 1;
-	assert( ISPOWEROFTWO(m_binPeriod+1) );
-  m_binIndex = 0;
-  m_binIndex2 = 0;
+  // bin counter period: least common multiple of all bin counts
+  m_binPeriod = 1;
+  for (size_t i=0; i < m_convs.size(); ++i) {
+    m_binPeriod = m_binPeriod / gcd(m_binPeriod, m_convs[i]->numBins()) * m_convs[i]->numBins();
+  }
 	
-	if (response.numModules() > m_numRTProcs) {
-	  const Response::Module& module = response[m_numRTProcs];
-    size_t irOffset = module.offset();
-    m_process = new Process(this, response.numChannels(), binSize, irOffset, irOffset*4);
+	if (m_split < m_convs.size()) {
+    m_process = new Process(this);
+  }
+
+  // partitions that may be faded out on overload, latest first
+  if (m_overloadPolicy != kOverloadWait) {
+    for (size_t i=m_convs.size(); i > m_minSplit; --i) {
+      m_convs[i-1]->setDropLate(true);
+      for (size_t k=m_convs[i-1]->numPartitions(); k > 0; --k) {
+        m_shedOrder.push_back(PartitionIndex(i-1, k-1));
+      }
+    }
   }
 }
 
@@ -467,52 +1148,731 @@ VEP::Convolution::~Convolution()
   delete m_process;
   for (ConvolverArray::iterator it = m_convs.begin(); it != m_convs.end(); ++it)
     delete *it;
+  for (size_t c=0; c < m_tails.size(); ++c)
+    delete m_tails[c];
 }
 
 void VEP::Convolution::process(float** dst, const float** src, size_t numChannels, size_t numFrames)
 {
 	//assert( (dst != src) && (dst->getSampleData(0) != src->getSampleData(0)) );
+  assert( numChannels == m_response.numChannels() );
 
-	if (m_process && !m_process->write(src, numChannels, numFrames))
-	{
-#ifndef NDEBUG
-    printf("VEP::Convolution: couldn't write to process\n");
-#endif
-    size_t numTries = 100;
-		while (/*(numTries-- > 0) &&*/ !m_process->write(src, numChannels, numFrames)) /* SPINLOCK */;
-	}
-	
-  for (size_t i=0; i < std::min(m_numRTProcs, m_convs.size()); ++i)
-	{
-    m_convs[i]->process(dst, src, numChannels, numFrames, m_binPeriod);
+  VEP_TRACE_THREAD("VEP RT");
+  VEP_TRACE_SCOPE("process", (int)numFrames);
+  Timer timer;
+  m_waitTime = 0.;
+
+  if (!m_reblock) {
+    // host block is a multiple of the bin size: process bins in place
+    assert( (numFrames % binSize()) == 0 );
+    for (size_t i=0; i < numFrames; i += binSize()) {
+      for (size_t c=0; c < numChannels; ++c) {
+        m_srcChannelData[c] = const_cast<float*>(src[c]) + i;
+        m_dstChannelData[c] = dst[c] + i;
+      }
+      processBin(&m_dstChannelData[0], const_cast<const float**>(&m_srcChannelData[0]), numChannels);
+    }
+  } else {
+    assert( numFrames <= m_blockSize );
+
+    // collect input into bins and queue the output of each complete bin
+    VEP_TRACE_INSTANT("reblockWrite", (int)m_reblockFifo.writeSpace());
+    size_t pos = 0;
+    while (pos < numFrames) {
+      const size_t n = std::min(binSize() - m_reblockFill, numFrames - pos);
+      for (size_t c=0; c < numChannels; ++c) {
+        memCopy(m_reblockInput[c] + m_reblockFill, src[c] + pos, n);
+      }
+      m_reblockFill += n;
+      pos += n;
+
+      if (m_reblockFill == binSize()) {
+        for (size_t c=0; c < numChannels; ++c) {
+          m_srcChannelData[c] = m_reblockInput[c];
+          m_dstChannelData[c] = m_reblockOutput[c];
+        }
+        processBin(&m_dstChannelData[0], const_cast<const float**>(&m_srcChannelData[0]), numChannels);
+        m_reblockFill = 0;
+
+        size_t remain = binSize();
+        while (remain > 0) {
+          const size_t wn = std::min(remain, m_reblockFifo.writeSpace());
+          assert( wn > 0 );
+          for (size_t c=0; c < numChannels; ++c) {
+            memCopy(m_reblockFifo.writeVector(c), m_reblockOutput[c] + binSize() - remain, wn);
+          }
+          m_reblockFifo.writeAdvance(wn);
+          remain -= wn;
+        }
+      }
+    }
+
+    // dequeue output; the pre-delay guarantees enough frames are available
+    VEP_TRACE_INSTANT("reblockRead", (int)m_reblockFifo.readSpace());
+    pos = 0;
+    while (pos < numFrames) {
+      const size_t rn = std::min(numFrames - pos, m_reblockFifo.readSpace());
+      assert( rn > 0 );
+      for (size_t c=0; c < numChannels; ++c) {
+        memCopy(dst[c] + pos, m_reblockFifo.readVector(c), rn);
+      }
+      m_reblockFifo.readAdvance(rn);
+      pos += rn;
+    }
   }
-	
-	if (m_process && !m_process->read(dst, numChannels, numFrames))
+
+  if (m_adaptive && m_process) {
+    adaptSplit(timer.delta() - m_waitTime, numFrames);
+  }
+  if (!m_shedOrder.empty() && m_process) {
+    shedPartitions(numFrames);
+  }
+}
+
+void VEP::Convolution::processBin(float** dst, const float** src, size_t numChannels)
+{
+  const size_t numFrames = binSize();
+  bool pending = false;
+
+  for (size_t i=0; i < m_convs.size(); ++i)
 	{
+    Convolver* conv = m_convs[i];
+    // mode changes take effect at the next partition boundary
+    conv->setAsync(i >= m_split);
+    if (m_overloadPolicy != kOverloadWait) {
+      // never wait: late output is dropped and input the worker has no
+      // room for is discarded (see Convolver::pushInput)
+      m_overloaded = m_overloaded || conv->isLate(1);
+    } else if (conv->isLate()) {
 #ifndef NDEBUG
-      printf("VEP::Convolution: couldn't read from process\n");
+      printf("VEP::Convolution: waiting for worker (module %d)\n", (int)i);
 #endif
-    size_t numTries = 100;
-		while (/*(numTries-- > 0) &&*/ !m_process->read(dst, numChannels, numFrames)) /* SPINLOCK */;
-	}
+      VEP_TRACE_SCOPE("wait", (int)i);
+      Timer timer;
+      while (conv->isLate()) {
+        m_process->signal(); /* SPINLOCK */
+      }
+      m_waitTime += timer.delta();
+    }
+    conv->process(dst, src, numChannels, numFrames, m_binPeriod);
+    pending = pending || conv->hasPendingJob();
+  }
+
+  processTaps(dst, src, numChannels);
+
+  // the networks run even without a fitted tail, so that their input
+  // delay is filled when the next kernel has one
+  for (size_t c=0; c < m_tails.size(); ++c) {
+    m_tails[c]->process(dst[c], src[c], numFrames);
+  }
+
+  if (pending) {
+    VEP_TRACE_INSTANT("signal", 0);
+    m_process->signal();
+  }
 }
 
-void VEP::Convolution::process2(float** dst, const float** src, size_t numChannels, size_t numFrames)
+void VEP::Convolution::processTaps(float** dst, const float** src, size_t numChannels)
 {
-  // jassert( (dst != src) && (dst->getSampleData(0) != src->getSampleData(0)) );
+  if (m_tapDelay == 0) return;
 
-  for (size_t i=m_numRTProcs; i < m_convs.size(); ++i)
-	{
-    m_convs[i]->process(dst, src, numChannels, numFrames, m_binPeriod);
+  const size_t numFrames = binSize();
+  const size_t size = m_tapDelay + numFrames;
+
+  // write input twice, then read every delay from the second copy
+  for (size_t c=0; c < numChannels; ++c) {
+    memCopy(m_tapHistory[c] + m_tapPos, src[c], numFrames);
+    memCopy(m_tapHistory[c] + m_tapPos + size, src[c], numFrames);
   }
+
+  for (size_t i=0; i < m_convs.size(); ++i) {
+    const Kernel* kernel = m_convs[i]->kernel();
+    for (size_t k=0; k < kernel->numTaps(); ++k) {
+      const Kernel::Tap& tap = kernel->tap(k);
+      DSP::axpy(dst[tap.channel], tap.gain, m_tapHistory[tap.channel] + m_tapPos + size - tap.delay, numFrames);
+    }
+  }
+
+  m_tapPos = (m_tapPos + numFrames) % size;
 }
 
-void VEP::Convolution::setKernel(const float* data, size_t numChannels, size_t numFrames)
+bool VEP::Convolution::processAsync()
 {
-  // NOTE: NOT thread-safe!
+  // compute one step of the job with the earliest deadline
+  Convolver* next = 0;
+  for (size_t i=0; i < m_convs.size(); ++i)
+  {
+    Convolver* conv = m_convs[i];
+    if (conv->hasPendingJob() && ((next == 0) || (conv->jobDeadline() < next->jobDeadline()))) {
+      next = conv;
+    }
+  }
+  if (next == 0) return false;
+  next->computeJobStep();
+  return true;
+}
+
+bool VEP::Convolution::hasPendingJob() const
+{
+  for (size_t i=0; i < m_convs.size(); ++i)
+  {
+    if (m_convs[i]->hasPendingJob()) return true;
+  }
+  return false;
+}
+
+double VEP::Convolution::moduleLoad(size_t i) const
+{
+  // time per partition relative to the partition period
+  return m_convs[i]->cost() * m_sampleRate / (double)m_convs[i]->partitionSize();
+}
+
+void VEP::Convolution::adaptSplit(double rtTime, size_t numFrames)
+{
+  const double load = rtTime * m_sampleRate / (double)numFrames;
+  m_rtLoad = m_rtLoad * 0.9 + load * 0.1;
+
+  // let the load settle after a change
+  if (m_holdOff > 0) {
+    m_holdOff -= std::min(m_holdOff, numFrames);
+    return;
+  }
+
+  const bool workerLate = m_waitTime > 0.;
+  
+  if ((m_rtLoad > m_maxRTLoad) && (m_split > m_minSplit)) {
+    // move the last RT module to the worker if it can take it
+    const size_t i = m_split - 1;
+    double workerLoad = moduleLoad(i);
+    for (size_t j=m_split; j < m_convs.size(); ++j) {
+      workerLoad += moduleLoad(j);
+    }
+    // the worker must also finish in time after a late wakeup
+    const double slack = (double)(m_convs[i]->irOffset() - m_convs[i]->partitionSize()) / m_sampleRate;
+    if (!workerLate && (workerLoad < 0.9) && (m_convs[i]->cost() + maxWakeLatency() < slack)) {
+      m_split--;
+      m_holdOff = 2 * m_convs[i]->partitionSize();
+    }
+  } else if (m_split < m_convs.size()) {
+    // move the first worker module back to the RT thread if there's
+    // headroom, or if the worker can't keep up
+    const size_t i = m_split;
+    if ((m_convs[i]->cost() > 0.)
+        && ((m_rtLoad + moduleLoad(i) < m_maxRTLoad * 0.8)
+            || (workerLate && (m_rtLoad + moduleLoad(i) < m_maxRTLoad)))) {
+      m_split++;
+      m_holdOff = 2 * m_convs[i]->partitionSize();
+    }
+  }
+}
+
+double VEP::Convolution::kernelError() const
+{
+  double e = 0., s = 0.;
+  for (size_t i=0; i < m_convs.size(); ++i) {
+    e += m_convs[i]->kernelErrorEnergy();
+    s += m_convs[i]->kernelEnergy();
+  }
+  return s > 0. ? sqrt(e / s) : 0.;
+}
+
+double VEP::Convolution::tapError() const
+{
+  double e = 0., s = 0.;
+  for (size_t i=0; i < m_convs.size(); ++i) {
+    e += m_convs[i]->tapErrorEnergy();
+    s += m_convs[i]->irEnergy();
+  }
+  return s > 0. ? sqrt(e / s) : 0.;
+}
+
+size_t VEP::Convolution::numTaps() const
+{
+  size_t n = 0;
+  for (size_t i=0; i < m_convs.size(); ++i)
+    n += m_convs[i]->kernel()->numTaps();
+  return n;
+}
+
+size_t VEP::Convolution::numSparsePartitions() const
+{
+  size_t n = 0;
+  for (size_t i=0; i < m_convs.size(); ++i)
+    n += m_convs[i]->kernel()->numSparse();
+  return n;
+}
+
+void VEP::Convolution::printPerfStats(FILE* stream) const
+{
+  // per call averages; the MAC is also given per frame of partition
+  // size, which is comparable across modules
+  for (size_t i=0; i < m_convs.size(); ++i) {
+    const Convolver* conv = m_convs[i];
+    fprintf(stream, "BENCH perf %d size %d parts %d %s:",
+            (int)i, (int)conv->partitionSize(), (int)conv->numPartitions(),
+            i < m_split ? "rt" : "worker");
+    Perf::print(stream, "input", conv->perfStats(Convolver::kStageInput));
+    Perf::print(stream, "mac", conv->perfStats(Convolver::kStageMAC));
+    Perf::print(stream, "mac/frame", conv->perfStats(Convolver::kStageMAC), (double)conv->partitionSize());
+    Perf::print(stream, "output", conv->perfStats(Convolver::kStageOutput));
+    fprintf(stream, "\n");
+  }
+}
+
+void VEP::Convolution::setPhase(size_t frame)
+{
+  // process bins of silence, so that partition boundaries coincide
+  // with those of other convolutions with the same response
+  const size_t numBins = (frame / binSize()) % m_binPeriod;
+  for (size_t k=0; k < numBins; ++k) {
+    for (size_t i=0; i < m_convs.size(); ++i) {
+      m_convs[i]->skipBin(m_binPeriod);
+    }
+  }
+}
+
+size_t VEP::Convolution::numDropped() const
+{
+  size_t n = 0;
   for (size_t i=0; i < m_convs.size(); ++i)
+    n += m_convs[i]->numDropped();
+  return n;
+}
+
+void VEP::Convolution::shedPartitions(size_t numFrames)
+{
+  const bool overloaded = m_overloaded;
+  m_overloaded = false;
+  
+  if (m_shedHoldOff > 0) {
+    m_shedHoldOff -= std::min(m_shedHoldOff, numFrames);
+    return;
+  }
+
+  if (overloaded) {
+    m_calmFrames = 0;
+    if (m_numShed < m_shedOrder.size()) {
+      // fade out the next partition
+      const PartitionIndex& p = m_shedOrder[m_numShed++];
+      m_convs[p.first]->setPartitionActive(p.second, false);
+      m_shedHoldOff = 2 * m_convs[p.first]->partitionSize();
+    }
+  } else if (m_numShed > 0) {
+    m_calmFrames += numFrames;
+    if (m_calmFrames >= (size_t)m_sampleRate) {
+      // fade the last partition back in
+      const PartitionIndex& p = m_shedOrder[--m_numShed];
+      m_convs[p.first]->setPartitionActive(p.second, true);
+      m_calmFrames = 0;
+      m_shedHoldOff = 2 * m_convs[p.first]->partitionSize();
+    }
+  }
+}
+
+struct PartitionEnergyLess
+{
+  PartitionEnergyLess(const std::vector<Kernel*>& kernels)
+    : m_kernels(kernels)
+  { }
+  bool operator () (const std::pair<size_t,size_t>& a, const std::pair<size_t,size_t>& b) const
   {
-    m_convs[i]->setKernel(data, numChannels, numFrames);
+    const float ea = m_kernels[a.first]->partitionEnergy(a.second);
+    const float eb = m_kernels[b.first]->partitionEnergy(b.second);
+    if (ea != eb) return ea < eb;
+    // latest first
+    return (a.first != b.first) ? (a.first > b.first) : (a.second > b.second);
+  }
+  const std::vector<Kernel*>& m_kernels;
+};
+
+void VEP::Convolution::sortShedOrder(StagedKernel* staged) const
+{
+  // quietest partitions of the staged kernel first
+  staged->m_shedOrder = m_shedOrder;
+  std::sort(staged->m_shedOrder.begin(), staged->m_shedOrder.end(), PartitionEnergyLess(staged->m_kernels));
+}
+
+VEP::Convolution::StagedKernel::~StagedKernel()
+{
+  for (size_t i=0; i < m_kernels.size(); ++i) {
+    m_kernels[i]->release();
+    if (m_swapped[i]) m_swapped[i]->release();
+  }
+}
+
+bool VEP::Convolution::StagedKernel::isInUse() const
+{
+  for (size_t i=0; i < m_swapped.size(); ++i) {
+    if (m_swapped[i] && m_swapped[i]->isRead(m_generations[i])) return true;
+  }
+  return false;
+}
+
+VEP::Convolution::StagedKernel* VEP::Convolution::stageKernel(const float* data, size_t numChannels, size_t numFrames) const
+{
+  StagedKernel* staged = new StagedKernel;
+  staged->m_swapped.resize(m_convs.size(), 0);
+  staged->m_generations.resize(m_convs.size(), 0);
+  staged->m_tailActive = false;
+
+  // in tail mode the IR is faded out after the cutoff
+  const size_t fadeStart = m_tailCutoff > 0 ? m_tailCutoff : (size_t)-1;
+  const size_t fadeLength = m_tailCutoff > 0 ? FDN::fadeLength(m_sampleRate) : 0;
+  // sparse partitions are detected relative to the IR peak
+  float peak = 0.f;
+  for (size_t i=0; i < numChannels * numFrames; ++i)
+    peak = std::max(peak, fabsf(data[i]));
+  const float threshold = peak * m_sparseThreshold;
+  for (size_t i=0; i < m_convs.size(); ++i)
+  {
+    staged->m_kernels.push_back(m_convs[i]->newKernel());
+    m_convs[i]->transformKernel(staged->m_kernels.back(), data, numChannels, numFrames,
+                                m_tapDelay, threshold, fadeStart, fadeLength);
+  }
+  if (m_tailCutoff > 0) {
+    fitTail(staged, data, numChannels, numFrames);
+  }
+  if (m_overloadPolicy == kOverloadDropQuietest) {
+    sortShedOrder(staged);
+  }
+
+  return staged;
+}
+
+void VEP::Convolution::swapKernel(StagedKernel* staged)
+{
+  assert( staged->m_kernels.size() == m_convs.size() );
+
+  for (size_t i=0; i < m_convs.size(); ++i)
+  {
+    if (staged->m_swapped[i]) continue;
+    // the convolver's kernel stays alive until the previous contents
+    // are released
+    staged->m_swapped[i] = m_convs[i]->kernel();
+    staged->m_swapped[i]->retain();
+    staged->m_generations[i] = m_convs[i]->swapKernel(staged->m_kernels[i]);
+  }
+
+  for (size_t c=0; c < staged->m_tails.size(); ++c) {
+    const StagedKernel::Tail& tail = staged->m_tails[c];
+    if (tail.gain > 0.f) m_tails[c]->setDecay(tail.decayLow, tail.decayHigh);
+    m_tails[c]->setGain(tail.gain);
+  }
+  m_tailActive = staged->m_tailActive;
+
+  if (m_overloadPolicy == kOverloadDropQuietest) {
+    m_shedOrder.swap(staged->m_shedOrder);
+    for (size_t i=0; i < m_shedOrder.size(); ++i) {
+      m_convs[m_shedOrder[i].first]->setPartitionActive(m_shedOrder[i].second, i >= m_numShed);
+    }
+  }
+}
+
+void VEP::Convolution::releaseKernel(StagedKernel* staged)
+{
+  // partitions are short compared to the NRT latency, so polling is
+  // good enough
+  while (staged->isInUse()) {
+    usleep(1000);
+  }
+  delete staged;
+}
+
+void VEP::Convolution::setKernel(const float* data, size_t numChannels, size_t numFrames)
+{
+  // NOTE: NOT thread-safe!
+  StagedKernel* staged = stageKernel(data, numChannels, numFrames);
+  swapKernel(staged);
+  releaseKernel(staged);
+}
+
+// audit pulse; wider than Kernel::kMaxPartitionTaps, so that the audit
+// goes through the FFT path
+static const float kAuditPulse[] = { 0.25f, 0.5f, 1.f, 0.5f, 0.25f };
+static const size_t kAuditPulseSize = sizeof(kAuditPulse) / sizeof(float);
+
+bool VEP::Convolution::audit(const Response& response, size_t blockSize, double sampleRate,
+                             const Options& options, FILE* stream)
+{
+  // the worker is waited for and the kernel stored exactly, so every
+  // partition has to come out of the test instance unaltered
+  Options testOptions(options);
+  testOptions.overloadPolicy = kOverloadWait;
+  testOptions.kernelFormat = kKernelFloat32;
+  testOptions.batch = 0;
+  testOptions.tailCutoff = 0;
+
+  const size_t numChannels = response.numChannels();
+  const size_t numFrames = response.size();
+  const size_t numParts = response.numPartitions() * numChannels;
+  // a distinct amplitude per partition and channel
+  const double tolerance = std::min(1e-3, 0.25 / numParts);
+
+  std::vector<size_t> centers;
+  std::vector<float> ir(numFrames * numChannels, 0.f);
+  for (size_t i=0; i < response.numModules(); ++i) {
+    const Response::Module& module = response[i];
+    for (size_t k=0; k < module.count(); ++k) {
+      const size_t center = module.offset() + k * module.size() + module.size() / 2;
+      for (size_t c=0; c < numChannels; ++c) {
+        const float amp = 1.f - 0.5f * (centers.size() * numChannels + c) / numParts;
+        for (size_t j=0; j < kAuditPulseSize; ++j) {
+          ir[(center + j - kAuditPulseSize / 2) * numChannels + c] = amp * kAuditPulse[j];
+        }
+      }
+      centers.push_back(center);
+    }
+  }
+
+  Convolution conv(response, blockSize, sampleRate, testOptions);
+  conv.setKernel(&ir[0], numChannels, numFrames);
+
+  const size_t latency = conv.latency();
+  const size_t numOutFrames = numFrames + latency + blockSize;
+  AudioBuffer input(numChannels, blockSize);
+  AudioBuffer output(numChannels, numOutFrames + blockSize);
+  std::vector<float*> outPtrs(numChannels);
+  for (size_t c=0; c < numChannels; ++c) input[c][0] = 1.f;
+
+  for (size_t pos=0; pos < numOutFrames; pos += blockSize) {
+    for (size_t c=0; c < numChannels; ++c) outPtrs[c] = output[c] + pos;
+    conv.process(&outPtrs[0], const_cast<const float**>(input.channels()), numChannels, blockSize);
+    if (pos == 0) {
+      for (size_t c=0; c < numChannels; ++c) input[c][0] = 0.f;
+    }
+  }
+
+  bool passed = true;
+  size_t p = 0;
+  for (size_t i=0; i < response.numModules(); ++i) {
+    const Response::Module& module = response[i];
+    for (size_t k=0; k < module.count(); ++k, ++p) {
+      for (size_t c=0; c < numChannels; ++c) {
+        const float amp = 1.f - 0.5f * (p * numChannels + c) / numParts;
+        const float* out = output[c];
+        const size_t expected = centers[p] + latency;
+        if (fabs(out[expected] - amp) <= tolerance) continue;
+        passed = false;
+        // look for the pulse elsewhere
+        size_t found = numOutFrames;
+        for (size_t j=1; j+1 < numOutFrames; ++j) {
+          if ((fabs(out[j] - amp) <= tolerance)
+              && (fabs(out[j-1] - 0.5f * amp) <= tolerance)
+              && (fabs(out[j+1] - 0.5f * amp) <= tolerance)) {
+            found = j;
+            break;
+          }
+        }
+        if (found < numOutFrames) {
+          fprintf(stream, "VEP::Convolution::audit: module %d partition %d channel %d: offset %d\n",
+                  (int)i, (int)k, (int)c, (int)found - (int)expected);
+        } else {
+          fprintf(stream, "VEP::Convolution::audit: module %d partition %d channel %d: missing\n",
+                  (int)i, (int)k, (int)c);
+        }
+      }
+    }
+  }
+
+  if (passed) {
+    fprintf(stream, "VEP::Convolution::audit: %d partitions in %d modules aligned (latency %d)\n",
+            (int)response.numPartitions(), (int)response.numModules(), (int)latency);
+  }
+
+  return passed;
+}
+
+// duration of the IR the tail energy is matched to (seconds)
+static const double kTailMatchTime = 0.25;
+
+void VEP::Convolution::fitTail(StagedKernel* staged, const float* data, size_t numChannels, size_t numFrames) const
+{
+  // fit the decay to the IR after the cutoff and match the energy of
+  // the network to that of the IR during kTailMatchTime after the fade;
+  // the energy is measured on a separate network, the running ones
+  // only get the parameters when the kernel is swapped in
+  const size_t fadeLength = FDN::fadeLength(m_sampleRate);
+  const size_t matchBegin = m_tailCutoff + fadeLength;
+  const size_t matchEnd = std::min(numFrames, matchBegin + (size_t)(m_sampleRate * kTailMatchTime));
+
+  FDN fdn(m_sampleRate, 0);
+
+  for (size_t c=0; c < m_tails.size(); ++c) {
+    StagedKernel::Tail tail = { 0., 0., 0.f };
+    // the IR needs to extend at least a fade length past the fade
+    if ((c < numChannels)
+        && (matchEnd >= matchBegin + fadeLength)
+        && FDN::fitDecay(data, numChannels, c, m_tailCutoff, numFrames, m_sampleRate, tail.decayLow, tail.decayHigh)) {
+      fdn.setDecay(tail.decayLow, tail.decayHigh);
+      double irEnergy = 0.;
+      for (size_t i=matchBegin; i < matchEnd; ++i) {
+        const double x = data[i * numChannels + c];
+        irEnergy += x * x;
+      }
+      const double tailEnergy = fdn.impulseEnergy(matchBegin - m_tailCutoff, matchEnd - m_tailCutoff);
+      if (tailEnergy > 0.) {
+        tail.gain = (float)sqrt(irEnergy / tailEnergy);
+        staged->m_tailActive = true;
+      }
+    }
+    staged->m_tails.push_back(tail);
+  }
+}
+
+// =====================================================================
+// VEP::Batch
+
+// registry of batches (NRT)
+static Batch* gBatches = 0;
+
+VEP::Batch::Batch(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat)
+  : m_id(id),
+    m_response(response),
+    m_blockSize(blockSize),
+    m_binsPerBlock((blockSize + response.minPartSize() - 1) / response.minPartSize()),
+    m_kernelFormat(kernelFormat),
+    m_refCount(1),
+    m_bufnum(-1),
+    m_members(0),
+    m_numMembers(0),
+    m_blockCount(0),
+    m_processed(false),
+    m_next(0)
+{
+  for (size_t i=0; i < response.numModules(); ++i) {
+    const Response::Module& module = response[i];
+    m_kernels.push_back(new Kernel(response.numChannels(), module.count(), module.fft()->paddedSize(), kernelFormat));
+    m_batched.push_back(Convolver::canBeBatched(module, response.minPartSize(), m_binsPerBlock));
+  }
+}
+
+VEP::Batch::~Batch()
+{
+  assert( m_members == 0 );
+  for (size_t i=0; i < m_kernels.size(); ++i)
+    m_kernels[i]->release();
+}
+
+bool VEP::Batch::matches(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat) const
+{
+  return (m_id == id)
+    && (m_response.numChannels() == response.numChannels())
+    && (m_response.numFrames() == response.numFrames())
+    && (m_response.minPartSize() == response.minPartSize())
+    && (m_response.maxPartSize() == response.maxPartSize())
+    && (m_blockSize == blockSize)
+    && (m_kernelFormat == kernelFormat);
+}
+
+VEP::Batch* VEP::Batch::acquire(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat)
+{
+  for (Batch* batch = gBatches; batch != 0; batch = batch->m_next) {
+    if (batch->matches(id, response, blockSize, kernelFormat)) {
+      batch->m_refCount++;
+      return batch;
+    }
+  }
+  Batch* batch = new Batch(id, response, blockSize, kernelFormat);
+  batch->m_next = gBatches;
+  gBatches = batch;
+  return batch;
+}
+
+void VEP::Batch::release()
+{
+  if (--m_refCount > 0) return;
+  for (Batch** it = &gBatches; *it != 0; it = &(*it)->m_next) {
+    if (*it == this) {
+      *it = m_next;
+      break;
+    }
+  }
+  delete this;
+}
+
+void VEP::Batch::add(Convolution* conv)
+{
+  assert( conv->m_batchNext == 0 );
+  conv->m_batchNext = m_members;
+  m_members = conv;
+  m_numMembers++;
+}
+
+void VEP::Batch::remove(Convolution* conv)
+{
+  for (Convolution** it = &m_members; *it != 0; it = &(*it)->m_batchNext) {
+    if (*it == conv) {
+      *it = conv->m_batchNext;
+      conv->m_batchNext = 0;
+      m_numMembers--;
+      return;
+    }
+  }
+}
+
+void VEP::Batch::process(int blockCount)
+{
+  if (m_processed && (blockCount == m_blockCount)) return;
+  m_processed = true;
+  m_blockCount = blockCount;
+
+  VEP_TRACE_SCOPE("batch", (int)m_numMembers);
+
+  for (size_t i=0; i < m_kernels.size(); ++i) {
+    if (!m_batched[i]) continue;
+    // finish partitions started in an earlier block first, then start
+    // the partitions completed in the last block
+    if (select(i, 1)) computeStage(i, 1);
+    if (select(i, 0)) {
+      computeStage(i, 0);
+      if (select(i, 1)) computeStage(i, 1);
+    }
+  }
+}
+
+bool VEP::Batch::select(size_t module, size_t stage)
+{
+  bool any = false;
+  for (Convolution* member = m_members; member != 0; member = member->m_batchNext) {
+    Convolver* conv = member->m_convs[module];
+    conv->m_batchMark = conv->needsBatchStage(stage, m_binsPerBlock);
+    any = any || conv->m_batchMark;
+  }
+  return any;
+}
+
+void VEP::Batch::computeStage(size_t module, size_t stage)
+{
+  // MACs partition by partition for all selected members
+  const size_t numPartitions = m_response[module].count();
+  const size_t begin = stage == 0 ? 0 : numPartitions/2;
+  const size_t end = stage == 0 ? numPartitions/2 : numPartitions;
+
+  if (stage == 0) {
+    for (Convolution* member = m_members; member != 0; member = member->m_batchNext) {
+      Convolver* conv = member->m_convs[module];
+      if (!conv->m_batchMark) continue;
+      conv->computeInput();
+      conv->m_stageBin = conv->m_binCount;
+      conv->m_stage = 1;
+    }
+  }
+
+  for (size_t k=begin; k < end; ++k) {
+    for (Convolution* member = m_members; member != 0; member = member->m_batchNext) {
+      Convolver* conv = member->m_convs[module];
+      if (conv->m_batchMark) conv->computeMAC(k);
+    }
+  }
+
+  if (stage == 1) {
+    for (Convolution* member = m_members; member != 0; member = member->m_batchNext) {
+      Convolver* conv = member->m_convs[module];
+      if (!conv->m_batchMark) continue;
+      conv->computeOutput();
+      conv->finishPartition();
+      conv->m_stage = 0;
+    }
   }
 }
 
@@ -542,126 +1902,57 @@ void set_real_time_priority(pthread_t thread)
 	pthread_setschedparam (thread, policy, &param);
 }
 
-VEP::Convolution::Process::Process(Convolution* owner, size_t numChannels, size_t binSize, size_t irOffset, size_t fifoSize)
+VEP::Convolution::Process::Process(Convolution* owner)
 	: m_owner(owner),
-		m_numChannels(numChannels),
-		m_binSize(binSize),
-		m_irOffset(irOffset),
-		m_initialDelay(irOffset),
-		m_inFifo(numChannels, fifoSize),
-		m_outFifo(numChannels, fifoSize)
-{
-  m_srcChannelData = new float*[m_numChannels];
-  m_dstChannelData = new float*[m_numChannels];
-  //m_outFifo.writeAdvance(irOffset);
-  printf("Process::Process(): irOffset=%d binSize=%d rspace=%d\n", irOffset, binSize, m_outFifo.readSpace());
+    m_shouldBeRunning(true),
+    m_wakeLatency(0.),
+    m_maxWakeLatency(0.)
+{
   pthread_create(&m_thread, 0, threadFunc, this);
-  m_cond.wait();
-  printf("Process: orspace=%d\n", m_outFifo.readSpace());
 }
 
 VEP::Convolution::Process::~Process()
 {
   m_shouldBeRunning = false;
-  m_cond.signal();
+  m_event.signal();
   pthread_join(m_thread, 0);
-  
-  delete [] m_srcChannelData;
-  delete [] m_dstChannelData;
-}
-
-bool VEP::Convolution::Process::write(const float** buffer, size_t numChannels, size_t numSamples)
-{
-  // printf("Process::write: wspace=%d numSamples=%d\n", m_inFifo.writeSpace(), numSamples);
-  
-	if (m_inFifo.writeSpace() < numSamples)
-		return false;
-
-  for (size_t c=0; c < std::min(numChannels, m_numChannels); ++c) {
-    memCopy(m_inFifo.writeVector(c), buffer[c], numSamples);
-	}
-	
-  m_inFifo.writeAdvance(numSamples);
-	
-  m_cond.signal();
-	
-	return true;
-}
-
-bool VEP::Convolution::Process::read(float** buffer, size_t numChannels, size_t numSamples)
-{
-  // printf("Process::read: rspace=%d numSamples=%d\n", m_inFifo.readSpace(), numSamples);
-
-  // if (m_initialDelay > 0) {
-  //   assert( (m_initialDelay % numSamples) == 0 );
-  //   m_initialDelay -= numSamples;
-  //   return true;
-  // }
-  
-	if (m_outFifo.readSpace() < numSamples) {
-    // printf("read failure: %d < %d\n", m_outFifo.readSpace(), numSamples);
-		return false;
-	}
-	
-	for (size_t c=0; c < std::min(numChannels, m_numChannels); ++c) {
-		VEP::DSP::mix(buffer[c], m_outFifo.readVector(c), numSamples);
-	}
-	
-	m_outFifo.readAdvance(numSamples);
-	
-	return true;
 }
 
 void VEP::Convolution::Process::run()
 {
-  assert( (m_irOffset % m_binSize) == 0 );
-  
-  // for (size_t i=0; i < m_irOffset; i+=m_binSize)
-  // {
-  //  for (size_t c=0; c < m_numChannels; ++c)
-  //  {
-  //    m_srcChannelData[c] = m_inFifo.readVector(c);
-  //     memZero(m_srcChannelData[c], m_binSize);
-  //    m_dstChannelData[c] = m_outFifo.writeVector(c);
-  //     memZero(m_dstChannelData[c], m_binSize);
-  //  }
-  //  
-  //  m_owner->process2(m_dstChannelData, const_cast<const float**>(m_srcChannelData), m_numChannels, m_binSize);
-  // 
-  //    m_inFifo.readAdvance(m_binSize);
-  //  m_outFifo.writeAdvance(m_binSize);
-  // }
-  
-  printf("run: orspace=%d\n", m_outFifo.readSpace());
-  
   set_real_time_priority(pthread_self());
-  m_cond.signal();
+  VEP_TRACE_THREAD("VEP worker");
+  // open the counters here, not on the first job
+  VEP_PERF_THREAD_OPEN();
   
-  m_shouldBeRunning = true;
   while (m_shouldBeRunning)
 	{
-    m_cond.wait();
-    
-    // printf("Process::run() rspace=%d wspace=%d binSize=%D\n", m_inFifo.readSpace(), m_outFifo.writeSpace(), m_binSize);
-    
-		while ((m_inFifo.readSpace() >= m_binSize) && (m_outFifo.writeSpace() >= m_binSize))
-		{
-      if (!m_shouldBeRunning) return;
-      
-      // printf("Process::run() processing\n");
-			for (size_t c=0; c < m_numChannels; ++c)
-			{
-				m_srcChannelData[c] = m_inFifo.readVector(c);
-				m_dstChannelData[c] = m_outFifo.writeVector(c);
-        memZero(m_dstChannelData[c], m_binSize);
-			}
-			
-			m_owner->process2(m_dstChannelData, const_cast<const float**>(m_srcChannelData), m_numChannels, m_binSize);
+    if (m_owner->processAsync())
+      continue;
 
-			m_inFifo.readAdvance(m_binSize);
-			m_outFifo.writeAdvance(m_binSize);
-		}
+    // sleep until the RT thread hands over the next job
+    const int key = m_event.prepareWait();
+    if (!m_shouldBeRunning || m_owner->hasPendingJob()) {
+      m_event.cancelWait();
+      continue;
+    }
+    bool woken;
+    {
+      VEP_TRACE_SCOPE("sleep", 0);
+      woken = m_event.wait(key, 0.1);
+    }
+    if (woken) {
+      const double latency = std::max(0., Timer::time() - m_event.signalTime());
+      VEP_TRACE_INSTANT("wake", (int)(latency * 1e6));
+      m_wakeLatency = m_wakeLatency > 0. ? m_wakeLatency * 0.99 + latency * 0.01 : latency;
+      // the peak decays, so that a single slow wakeup (e.g. the first)
+      // doesn't keep adaptSplit() from using the worker for good
+      m_maxWakeLatency = std::max(latency, m_maxWakeLatency * 0.999);
+    }
 	}
+
+  VEP_PERF_THREAD_CLOSE();
+  VEP_TRACE_THREAD_EXIT();
 }
 
 void* VEP::Convolution::Process::threadFunc(void* self)
@@ -24,13 +24,15 @@
 
 #include "VEP.h"
 #include "VEPBuffer.h"
+#include "VEPFDN.h"
 #include "VEPFFT.h"
+#include "VEPPerf.h"
 #include "VEPRingBuffer.h"
 
 #include "SC_PlugIn.h"
-#include "SC_SyncCondition.h"
 
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -44,6 +46,19 @@ using namespace VEP;
 // Encapsulates impulse response partitioning scheme.
 namespace VEP
 {
+  // Storage format of transformed IR partitions. The 16 bit formats
+  // halve the memory traffic of the MAC at the cost of precision; half
+  // precision partitions are scaled individually.
+  enum KernelFormat
+  {
+    kKernelFloat32,
+    kKernelFloat16,
+    kKernelBFloat16
+  };
+
+  class Batch;
+  class Convolution;
+
   class Response
   {
   public:
@@ -98,6 +113,7 @@ namespace VEP
 
   protected:
     void initModules(size_t numFrames, size_t minSize, size_t maxSize);
+    size_t tailSize(size_t offset, size_t maxSize, size_t rest) const;
     size_t addModule(size_t offset, size_t size, size_t maxCount, size_t rest);
 
   private:
@@ -110,6 +126,103 @@ namespace VEP
     ModuleArray   m_modules;
   };
   
+  // =====================================================================
+  // VEP::Kernel
+  //
+  // Transformed IR partitions of one module. Kernels are reference
+  // counted, so that the convolvers of a batch can share them.
+  //
+  // A new IR is transformed into a separate kernel outside the RT
+  // thread and then swapped in, which only exchanges pointers. Workers
+  // bracket reading a kernel with beginRead() and endRead(), so that
+  // the previous contents can be freed once the readers that started
+  // before the swap are done.
+
+  class Kernel
+  {
+  public:
+    // time-domain tap of a sparse partition
+    struct Tap
+    {
+      size_t  channel;
+      size_t  delay;      // frames from the start of the IR
+      float   gain;
+    };
+
+    // maximum number of taps per channel in a sparse partition; above
+    // that the MAC is cheaper
+    enum { kMaxPartitionTaps = 4 };
+
+    Kernel(size_t numChannels, size_t numPartitions, size_t fftSize, KernelFormat format);
+
+    void retain() { __sync_add_and_fetch(&m_refCount, 1); }
+    void release() { if (__sync_sub_and_fetch(&m_refCount, 1) == 0) delete this; }
+
+    // exchange the contents with a kernel of the same shape (RT; doesn't
+    // allocate) and return the generation of the previous contents
+    unsigned swap(Kernel& other);
+    // register a reader of the current contents and return their
+    // generation
+    unsigned beginRead();
+    void endRead(unsigned generation) { __sync_sub_and_fetch(&m_numReaders[generation & 1], 1); }
+    // true while readers of contents of generation are registered
+    bool isRead(unsigned generation) const { return atomicLoad(m_numReaders[generation & 1]) > 0; }
+
+    KernelFormat format() const { return m_format; }
+    size_t numChannels() const { return m_numChannels; }
+    size_t numPartitions() const { return m_numPartitions; }
+    size_t fftSize() const { return m_fftSize; }
+
+    // partition spectrum (32 or 16 bit, depending on format())
+    float* data(size_t c, size_t i) { return m_data[c] + i * m_fftSize; }
+    uint16_t* data16(size_t c, size_t i) { return m_data16[c] + i * m_fftSize; }
+    // half precision scale of a partition
+    float& scale(size_t c, size_t i) { return m_scale[c * m_numPartitions + i]; }
+    // partition energy
+    float& partitionEnergy(size_t i) { return m_partEnergy[i]; }
+
+    // sparse partitions are rendered from taps instead of the spectrum
+    bool isSparse(size_t i) const { return m_sparse[i]; }
+    size_t numSparse() const;
+    size_t numTaps() const { return m_numTaps; }
+    const Tap& tap(size_t i) const { return m_taps[i]; }
+    void clearTaps();
+    void setSparse(size_t i) { m_sparse[i] = true; }
+    void addTap(size_t channel, size_t delay, float gain);
+    // squared error of the sparse partitions (samples below the
+    // threshold that are not rendered)
+    double tapErrorEnergy() const { return m_tapErrorEnergy; }
+    void addTapError(double errorEnergy) { m_tapErrorEnergy += errorEnergy; }
+
+    // squared error and energy of the stored spectrum
+    double errorEnergy() const { return m_errorEnergy; }
+    double energy() const { return m_energy; }
+    void clearStats();
+    void addStats(double errorEnergy, double energy) { m_errorEnergy += errorEnergy; m_energy += energy; }
+
+  private:
+    ~Kernel() { }
+
+  private:
+    int                 m_refCount;
+    volatile unsigned   m_generation;     // incremented by swap()
+    volatile int        m_numReaders[2];  // per generation parity
+    KernelFormat        m_format;
+    size_t              m_numChannels;
+    size_t              m_numPartitions;
+    size_t              m_fftSize;
+    AudioBuffer         m_data;
+    Buffer<uint16_t>    m_data16;
+    std::vector<float>  m_scale;
+    std::vector<float>  m_partEnergy;
+    std::vector<char>   m_sparse;
+    std::vector<Tap>    m_taps;         // preallocated
+    size_t              m_numTaps;
+    double              m_tapErrorEnergy;
+    double              m_errorEnergy;
+    double              m_energy;
+  };
+
   // =====================================================================
   // Convolver
   //
@@ -118,11 +231,36 @@ namespace VEP
   class Convolver
   {
   public:
+    // Inner loops over all channels. Variants for 1, 2, 4 and 8
+    // channels and sizes of 64, 128 and 256 frames have the loop
+    // bounds fixed at compile time; others fall back to generic loops.
+    struct Loops
+    {
+      // dst = src
+      void (*copy)(float* const* dst, const float* const* src, size_t numChannels, size_t n);
+      // dst += src
+      void (*mix)(float* const* dst, const float* const* src, size_t numChannels, size_t n);
+      // dst += src1 * src2 (spectra of 2n values)
+      void (*cmac)(float* const* dst, const float* const* src1, const float* const* src2, size_t numChannels, size_t n);
+      // dst = src + overlap, overlap = src + n
+      void (*overlapAdd)(float* const* dst, const float* const* src, float* const* overlap, size_t numChannels, size_t n);
+      // size the loops are specialised for (0: any)
+      size_t size;
+    };
+    // return the loops for numChannels and size
+    static Loops loops(size_t numChannels, size_t size);
+
     Convolver(size_t numChannels,
               // smallest partition size N0
               size_t binSize,
               const Response::Module& module,
-              size_t externalDelay=0);
+              KernelFormat kernelFormat=kKernelFloat32,
+              // shared kernel (0: allocate)
+              Kernel* kernel=0,
+              // complete partitions that may still wait for computation
+              // when the next one is started (see isLate())
+              size_t slack=2);
+    ~Convolver();
     void release(InterfaceTable *ft, World *world);
 
     size_t numChannels() const { return m_numChannels; }
@@ -136,8 +274,26 @@ namespace VEP
     const FFT* fft() const { return m_module.fft(); }
     size_t fftSize() const { return fft()->paddedSize(); }
     
-    // switch IRs (eventually perform crossfade)
-    void setKernel(const float* data, size_t numChannels, size_t numFrames);
+    // transform an IR into kernel, which has the shape of kernel();
+    // the processing state isn't touched, so this may run in any
+    // thread. Sparse partitions ending within maxTapDelay frames are
+    // rendered from taps, samples not above threshold count as silent;
+    // the IR is faded out over fadeLength frames from fadeStart
+    void transformKernel(Kernel* kernel, const float* data, size_t numChannels, size_t numFrames, size_t maxTapDelay=0,
+                         float threshold=0.f, size_t fadeStart=(size_t)-1, size_t fadeLength=0) const;
+    // allocate a kernel with the shape of kernel()
+    Kernel* newKernel() const;
+    // switch IRs by exchanging the contents of kernel() and kernel (RT)
+    unsigned swapKernel(Kernel* kernel) { return m_kernel->swap(*kernel); }
+    KernelFormat kernelFormat() const { return m_kernel->format(); }
+    const Kernel* kernel() const { return m_kernel; }
+    Kernel* kernel() { return m_kernel; }
+    // squared error and energy of the stored IR spectrum
+    double kernelErrorEnergy() const { return m_kernel->errorEnergy(); }
+    double kernelEnergy() const { return m_kernel->energy(); }
+    // squared error of the sparse partitions and energy of the IR
+    double tapErrorEnergy() const { return m_kernel->tapErrorEnergy(); }
+    double irEnergy() const;
 
     // simple process interface
     
@@ -146,21 +302,100 @@ namespace VEP
     
     // detailed process interface
     
-    // write time-domain input data
-    void pushInput(const float** src, size_t numChannels, size_t numFrames);
+    // write time-domain input data, return true if a partition is complete
+    bool pushInput(const float** src, size_t numChannels, size_t numFrames);
 
     // read time-domain output data
     void pullOutput(float** dst, size_t numChannels, size_t numFrames);
 
-    // do one partial convolution
-    void process(size_t binPeriod);
+    // advance as if a bin of silence had been processed (only before
+    // any input has been pushed)
+    void skipBin(size_t binPeriod);
+
+    // asynchronous process interface
+    //
+    // Partitions are either computed in two stages in the RT thread or
+    // as a whole by a worker thread calling computeJobStep(). The mode
+    // is selected when a partition is complete and only takes effect at
+    // partition boundaries, so switching is glitch free.
+
+    // true if the convolver has enough slack to be computed by a worker
+    static bool canBeAsync(const Response::Module& module) { return (module.offset() > 0) && (module.offset() >= 2 * module.size()); }
+    bool canBeAsync() const { return canBeAsync(m_module); }
+    // compute the following partitions in a worker thread
+    void setAsync(bool flag) { m_async = flag && canBeAsync(); }
+    bool isAsync() const { return m_async; }
+    // true if partitions are waiting for the worker
+    bool hasPendingJob() const { return atomicLoad(m_numComputed) < atomicLoad(m_numRequested); }
+    // true if the worker missed the deadline of a partition by more
+    // than slack - 1 partitions
+    bool isLate(size_t slack=1) const;
+    // deadline of the next pending partition in bins
+    size_t jobDeadline() const { return (m_numComputed + 2) * numBins(); }
+    // compute one step of the next pending partition; return true if
+    // the partition has been completed
+    bool computeJobStep();
+
+    // average time needed for computing a partition
+    double cost() const { return m_cost; }
+
+    // overload handling
+
+    // drop the output of late partitions instead of waiting for them,
+    // and discard the input of partitions the worker has no room for
+    void setDropLate(bool flag) { m_dropLate = flag; }
+    // number of bins dropped (late output or discarded input)
+    size_t numDropped() const { return m_numDropped; }
+    // fade IR partition in or out
+    void setPartitionActive(size_t i, bool flag) { m_partActive[i] = flag; }
+    // IR partition energy
+    float partitionEnergy(size_t i) const { return m_kernel->partitionEnergy(i); }
+
+    // batched interface
+    //
+    // Partitions of batched convolvers are computed by Batch::process
+    // at block boundaries instead of by compute(), unless they are
+    // handed to the worker.
+
+    // true if a partition can be computed up to a block after it is
+    // complete and at most one partition completes per block
+    static bool canBeBatched(const Response::Module& module, size_t binSize, size_t binsPerBlock)
+    {
+      return (module.offset() > 0) && (module.offset() >= module.size() + (binsPerBlock - 1) * binSize)
+          && (module.size() >= binsPerBlock * binSize);
+    }
+    void setBatched(bool flag) { m_batched = flag; }
+    bool isBatched() const { return m_batched; }
+
+    // performance counters per stage
+    enum Stage
+    {
+      kStageInput,
+      kStageMAC,
+      kStageOutput,
+      kNumStages
+    };
+    const Perf::Stats& perfStats(Stage stage) const { return m_perf[stage]; }
     
   protected:
+    friend class Batch;
+    bool hasRTJob() const;
+    bool needsBatchStage(size_t stage, size_t binsPerBlock) const;
     void compute(size_t binIndex);
     void computeOneStage(size_t stage);
     void computeInput();
+    void computeSilentInput();
     void computeMAC(size_t partition);
     void computeOutput();
+    void packKernel(Kernel* kernel, uint16_t* dst, float* scale, const float* src, size_t n) const;
+    void findTaps(Kernel* kernel, const float* data, size_t numChannels, size_t numFrames, size_t maxTapDelay,
+                  float threshold, size_t fadeStart, size_t fadeLength) const;
+    void cmac(float* dst, const float* spec, size_t channel, size_t partition);
+    void updateGains();
+    bool isPastDue() const;
+    bool hasInputSlot() const;
+    bool hasInput() const;
+    void finishPartition(bool skipped=false);
 
   private:
     size_t                  m_numChannels;
@@ -169,19 +404,73 @@ namespace VEP
     RingBuffer<float,true>  m_inputBuffer;
     AudioRingBuffer         m_inputSpecBuffer;
     RingBuffer<float,true>  m_outputBuffer;
-    AudioBuffer             m_irBuffer;
+    Kernel*                 m_kernel;         // IR spectrum
     AudioBuffer             m_fftMACBuffer;
     AudioBuffer             m_overlapBuffer;
     AudioBuffer             m_fftBuffer;
     size_t                  m_inputSpecPos;
     size_t                  m_stage;
     size_t                  m_binIndex;
+    // asynchronous state
+    bool                    m_async;
+    volatile size_t         m_binCount;       // bins processed (RT)
+    size_t                  m_numPushed;      // partitions complete (RT)
+    volatile size_t         m_numRequested;   // partitions handed to the worker (RT)
+    volatile size_t         m_numComputed;    // partitions computed
+    size_t                  m_jobStep;        // next step of the current job
+    unsigned                m_jobGeneration;  // kernel contents read by the current job
+    double                  m_jobTime;        // time spent on the current partition
+    double                  m_cost;           // average time per partition
+    // overload state
+    bool                    m_dropLate;
+    bool                    m_dropInput;      // input of the current partition discarded (RT)
+    std::vector<size_t>     m_slotPartition;  // partition index per input slot (RT)
+    size_t                  m_numDropped;
+    std::vector<char>       m_partActive;     // IR partition enabled (RT)
+    std::vector<float>      m_partGain;       // IR partition gain
+    // batch state
+    bool                    m_batched;
+    bool                    m_batchMark;      // selected for the current batch stage
+    size_t                  m_stageBin;       // bin count at the first stage
+    // inner loops and their channel pointers (bins: RT thread,
+    // partitions: computing thread)
+    Loops                   m_binLoops;
+    Loops                   m_partLoops;
+    std::vector<float*>     m_binPtrs;
+    std::vector<float*>     m_specPtrs;
+    std::vector<float*>     m_irPtrs;
+    std::vector<float*>     m_outPtrs;
+    // benchmark
+    Perf::Stats             m_perf[kNumStages];
   };
 
   // =====================================================================
   // VEP::Convolution
   //
   // Convolution process.
+  //
+  // The convolvers always run in bins of response().minPartSize()
+  // frames. Host blocks that are not a multiple of the bin size are
+  // re-blocked internally, which adds binSize - gcd(blockSize, binSize)
+  // frames of latency (see latency()).
+  //
+  // The first numRTProcs modules are computed in the RT thread, the
+  // others by a worker thread. In adaptive mode the split is adjusted
+  // while running, so that the time spent in the RT thread stays below
+  // maxRTLoad times the block period.
+  //
+  // When the worker can't keep up, the overload policy determines
+  // whether the RT thread waits for it or drops the output of late
+  // partitions. Dropping never waits: when the worker falls so far
+  // behind that a module's input FIFO is full, the input of the next
+  // partition is discarded and the worker computes it from silence.
+  // IR partitions are also faded out, either
+  // the latest or the quietest first, until the worker catches up, and
+  // faded back in after a second without overload.
+  //
+  // IR partitions within the first kMaxTapDelay frames that consist of
+  // a few discrete taps, such as the early reflections of a simulated
+  // room, are rendered by a multi-tap delay line instead of the MAC.
   
   class Convolution
   {
@@ -189,12 +478,16 @@ namespace VEP
   	class Process
   	{
   	public:
-  		Process(Convolution* owner, size_t numChannels, size_t binSize, size_t irOffset, size_t fifoSize);
+  		Process(Convolution* owner);
       ~Process();
       
-  		bool write(const float** buffer, size_t numChannels, size_t numSamples);
-  		bool read(float** buffer, size_t numChannels, size_t numSamples);
-      void signal() { m_cond.signal(); }
+      // wait-free, enters the kernel only if the worker sleeps
+      void signal() { m_event.signal(); }
+
+      // time from signal() to the worker running (average and decaying
+      // peak)
+      double wakeLatency() const { return m_wakeLatency; }
+      double maxWakeLatency() const { return m_maxWakeLatency; }
       
 		private:
       static void* threadFunc(void*);
@@ -202,47 +495,267 @@ namespace VEP
       
   	private:
   		Convolution*  					m_owner;
-  		size_t									m_numChannels;
-  		size_t									m_binSize;
-      size_t                  m_irOffset;
-  		// thread state
       pthread_t               m_thread;
-      Condition               m_cond;
-      bool                    m_shouldBeRunning;
-      size_t                  m_initialDelay;
-      // buffers
-  		RingBuffer<float,true>  m_inFifo;
-  		RingBuffer<float,true>  m_outFifo;
-      float**                 m_srcChannelData;
-      float**                 m_dstChannelData;
+      EventCount              m_event;
+      volatile bool           m_shouldBeRunning;
+      volatile double         m_wakeLatency;
+      volatile double         m_maxWakeLatency;
   	};
 	
   	typedef std::vector<Convolver*> ConvolverArray;
+
+    enum OverloadPolicy
+    {
+      kOverloadWait,          // wait for the worker
+      kOverloadDropLatest,    // fade out the latest IR partitions
+      kOverloadDropQuietest   // fade out the quietest IR partitions
+    };
+
+    struct Options
+    {
+      Options()
+        : numRTProcs(0),
+          maxRTLoad(0.5),
+          overloadPolicy(kOverloadWait),
+          kernelFormat(kKernelFloat32),
+          batch(0),
+          tailCutoff(0),
+          sparseThreshold(-90.)
+      { }
+
+      // number of modules computed in the RT thread
+      // (0: all modules, < 0: adaptive)
+      int     numRTProcs;
+      // adaptive mode: maximum fraction of the block period spent in
+      // the RT thread
+      double  maxRTLoad;
+      // what to do when the worker can't keep up
+      int     overloadPolicy;
+      // storage format of the IR spectrum
+      KernelFormat kernelFormat;
+      // share kernel and MACs with other members of a batch; the MACs
+      // of modules computed in the RT thread are batched, those of
+      // modules computed by the worker are not
+      Batch*  batch;
+      // render the IR past this frame with a feedback delay network
+      // fitted to the IR tail (0: off; not in batches); the response
+      // only needs to cover tailResponseSize() frames
+      size_t  tailCutoff;
+      // samples this far below the IR peak (dB) count as silent when
+      // looking for sparse partitions
+      double  sparseThreshold;
+    };
 	
+    // IR transformed outside the RT thread by stageKernel() and
+    // switched to by swapKernel(); afterwards it holds the previous
+    // kernel, which releaseKernel() frees once the worker is done with
+    // it.
+    class StagedKernel
+    {
+    public:
+      ~StagedKernel();
+      // true while a worker may still read the previous kernel
+      bool isInUse() const;
+
+    private:
+      friend class Convolution;
+      struct Tail
+      {
+        double  decayLow;
+        double  decayHigh;
+        float   gain;       // 0: no usable decay
+      };
+      std::vector<Kernel*>  m_kernels;      // per module
+      std::vector<Kernel*>  m_swapped;      // kernels swapped with (retained)
+      std::vector<unsigned> m_generations;  // of the previous contents
+      std::vector<Tail>     m_tails;
+      bool                  m_tailActive;
+      std::vector<std::pair<size_t,size_t> > m_shedOrder;
+    };
+
+    // extent of the tap delay line
+    enum { kMaxTapDelay = 4096 };
+
   public:
-  	Convolution(const Response& response, size_t numRTProcs=1);
+  	Convolution(const Response& response, size_t blockSize, double sampleRate, const Options& options=Options());
   	~Convolution();
 	
     const Response& response() const { return m_response; }
+    size_t binSize() const { return m_response.minPartSize(); }
+    size_t blockSize() const { return m_blockSize; }
+    // additional latency introduced by re-blocking
+    size_t latency() const { return m_latency; }
+    // number of modules currently computed in the RT thread
+    size_t numRTProcs() const { return m_split; }
+    // number of IR partitions faded out due to overload
+    size_t numShed() const { return m_numShed; }
+    // number of output bins dropped due to overload
+    size_t numDropped() const;
+    // worker wakeup latency in seconds (average and decaying peak)
+    double wakeLatency() const { return m_process ? m_process->wakeLatency() : 0.; }
+    double maxWakeLatency() const { return m_process ? m_process->maxWakeLatency() : 0.; }
     
-  	// PRE: dst != src
+  	// PRE: dst != src, numFrames <= blockSize()
   	void process(float** dst, const float** src, size_t numChannels, size_t numFrames);
+    // transform an IR in the NRT thread; may run concurrently with
+    // process()
+    StagedKernel* stageKernel(const float* data, size_t numChannels, size_t numFrames) const;
+    // switch to a staged IR in the RT thread; only exchanges pointers
+    void swapKernel(StagedKernel* staged);
+    // free a staged IR in the NRT thread, after waiting for the worker
+    // to finish the partitions it started with the previous kernel
+    static void releaseKernel(StagedKernel* staged);
+    // stage, swap and release (only while not processing)
     void setKernel(const float* data, size_t numChannels, size_t numFrames);
+    // relative RMS error of the stored IR spectrum
+    double kernelError() const;
+    // number of taps and of partitions rendered from taps or skipped
+    size_t numTaps() const;
+    size_t numSparsePartitions() const;
+    // relative RMS error of the IR due to sparse partitions
+    double tapError() const;
+    // print performance counters per module (benchmark build)
+    void printPerfStats(FILE* stream) const;
+    // advance the bin phase to that of a convolution started at frame
+    // 0 (only before the first call to process)
+    void setPhase(size_t frame);
+
+    // feed an impulse through a test instance with the same response
+    // and options and check that every IR partition shows up at its
+    // offset; misaligned partitions are reported to stream
+    static bool audit(const Response& response, size_t blockSize, double sampleRate,
+                      const Options& options, FILE* stream);
+
+    // frames of IR convolved in tail mode
+    static size_t tailResponseSize(size_t tailCutoff, double sampleRate) { return tailCutoff + FDN::fadeLength(sampleRate); }
+    // true if the current kernel has a parametric tail
+    bool hasTail() const { return m_tailActive; }
+    const FDN* tail(size_t channel) const { return m_tails[channel]; }
     
   protected:
   	friend class Process;
-  	void process2(float** dst, const float** src, size_t numChannels, size_t numFrames);
-    void processAsync();
+    friend class Batch;
+    void processBin(float** dst, const float** src, size_t numChannels);
+    void processTaps(float** dst, const float** src, size_t numChannels);
+    void fitTail(StagedKernel* staged, const float* data, size_t numChannels, size_t numFrames) const;
+    bool processAsync();
+    bool hasPendingJob() const;
+    void adaptSplit(double rtTime, size_t numFrames);
+    double moduleLoad(size_t i) const;
+    void shedPartitions(size_t numFrames);
+    void sortShedOrder(StagedKernel* staged) const;
 
   private:
     Response            m_response;
+    size_t              m_blockSize;
+    double              m_sampleRate;
+    size_t              m_latency;
+    bool                m_reblock;
+    // re-blocking state
+    AudioBuffer         m_reblockInput;
+    AudioBuffer         m_reblockOutput;
+    AudioRingBuffer     m_reblockFifo;
+    size_t              m_reblockFill;
+    std::vector<float*> m_srcChannelData;
+    std::vector<float*> m_dstChannelData;
   	ConvolverArray			m_convs;
-  	size_t							m_numRTProcs;
   	size_t							m_binPeriod;
-  	size_t							m_binPeriod2;
-  	size_t							m_binIndex;
-  	size_t							m_binIndex2;
+    // tap delay line; input is written twice, so that every delay can
+    // be read contiguously
+    size_t              m_tapDelay;
+    AudioBuffer         m_tapHistory;
+    size_t              m_tapPos;
+    float               m_sparseThreshold;  // relative to the IR peak
+    // parametric tail per channel
+    size_t              m_tailCutoff;
+    std::vector<FDN*>   m_tails;
+    bool                m_tailActive;
+    // RT/worker split
+    bool                m_adaptive;
+    double              m_maxRTLoad;
+    size_t              m_minSplit;       // modules that can't be computed asynchronously
+    size_t              m_split;
+    double              m_rtLoad;         // RT time per block period (average)
+    double              m_waitTime;       // time spent waiting for the worker
+    size_t              m_holdOff;        // frames until the next split change
+    // overload handling
+    typedef std::pair<size_t,size_t> PartitionIndex;
+    int                 m_overloadPolicy;
+    std::vector<PartitionIndex> m_shedOrder;  // (module, partition) in shedding order
+    size_t              m_numShed;
+    size_t              m_shedHoldOff;    // frames until the next partition is shed
+    size_t              m_calmFrames;     // frames without overload
+    bool                m_overloaded;
   	Process*						m_process;
+    // batch member list (RT)
+    Convolution*        m_batchNext;
+  };
+
+  // =====================================================================
+  // VEP::Batch
+  //
+  // Convolutions with the same response and block size that share one
+  // kernel, e.g. the voices of a polyphonic patch. Partitions of
+  // modules with at least a block of slack are computed at block
+  // boundaries by the first member processed in a block, for all
+  // members at once and one IR partition at a time, so that the IR is
+  // streamed through the cache once per batch instead of once per
+  // member. Each member keeps its own RT/worker split and overload
+  // policy; partitions a member hands to its worker are computed there.
+  //
+  // Batches are created and released in the NRT thread and registered
+  // by id; members are added and removed in the RT thread.
+
+  class Batch
+  {
+  public:
+    // return the batch for id and configuration, create it if necessary
+    static Batch* acquire(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat);
+    void release();
+
+    int id() const { return m_id; }
+    const Response& response() const { return m_response; }
+    size_t blockSize() const { return m_blockSize; }
+    KernelFormat kernelFormat() const { return m_kernelFormat; }
+    // shared kernel of module i
+    Kernel* kernel(size_t i) const { return m_kernels[i]; }
+    // true if module i is computed by the batch
+    bool isBatched(size_t i) const { return m_batched[i]; }
+
+    // buffer the kernel was loaded from (-1: none)
+    int bufnum() const { return m_bufnum; }
+    void setBufnum(int bufnum) { m_bufnum = bufnum; }
+
+    void add(Convolution* conv);
+    void remove(Convolution* conv);
+    size_t numMembers() const { return m_numMembers; }
+
+    // compute the pending partitions of all members; only the first
+    // call for a block has an effect
+    void process(int blockCount);
+
+  protected:
+    Batch(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat);
+    ~Batch();
+    bool matches(int id, const Response& response, size_t blockSize, KernelFormat kernelFormat) const;
+    bool select(size_t module, size_t stage);
+    void computeStage(size_t module, size_t stage);
+
+  private:
+    int                   m_id;
+    Response              m_response;
+    size_t                m_blockSize;
+    size_t                m_binsPerBlock;
+    KernelFormat          m_kernelFormat;
+    std::vector<Kernel*>  m_kernels;
+    std::vector<char>     m_batched;
+    int                   m_refCount;
+    int                   m_bufnum;
+    Convolution*          m_members;
+    size_t                m_numMembers;
+    int                   m_blockCount;
+    bool                  m_processed;
+    Batch*                m_next;         // registry
   };
 };
 
@@ -20,6 +20,15 @@
 #ifndef VEP_DSP_HH_INCLUDED
 #define VEP_DSP_HH_INCLUDED
 
+#include <stdint.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__F16C__)
+# include <immintrin.h>
+#endif
+
 namespace VEP
 {
   namespace DSP
@@ -28,6 +37,11 @@ namespace VEP
     {
       while (n--) *dst++ += *src++;
     }
+
+    inline static void axpy_f(float* dst, float a, const float* src, size_t n)
+    {
+      while (n--) *dst++ += a * *src++;
+    }
   
     inline static void cmac_hc_f(float *dst, const float *src1, const float *src2, size_t n)
     {
@@ -49,6 +63,114 @@ namespace VEP
       dst[0] = d0;
       dst[4] = d4;
     }
+
+    // =================================================================
+    // Reduced precision storage
+    //
+    // Conversion between single precision and 16 bit formats, rounding
+    // to nearest even.
+
+    union FloatBits
+    {
+      float     f;
+      uint32_t  u;
+    };
+    
+    // IEEE 754 half precision
+    inline static uint16_t float_to_half(float x)
+    {
+      FloatBits f; f.f = x;
+      const uint32_t sign = f.u & 0x80000000u;
+      uint16_t h;
+      f.u ^= sign;
+      if (f.u >= ((127 + 16) << 23)) {
+        // overflow, Inf or NaN
+        h = f.u > (255u << 23) ? 0x7e00 : 0x7c00;
+      } else if (f.u < (113 << 23)) {
+        // subnormal or zero: align mantissa with a magic value
+        FloatBits magic; magic.u = ((127 - 15) + (23 - 10) + 1) << 23;
+        f.f += magic.f;
+        h = (uint16_t)(f.u - magic.u);
+      } else {
+        // normal: rebias exponent and round
+        const uint32_t odd = (f.u >> 13) & 1;
+        f.u += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+        h = (uint16_t)(f.u >> 13);
+      }
+      return h | (uint16_t)(sign >> 16);
+    }
+    inline static float half_to_float(uint16_t h)
+    {
+      FloatBits f;
+      f.u = (uint32_t)(h & 0x7fff) << 13;
+      const uint32_t exp = f.u & (0x7c00 << 13);
+      f.u += (127 - 15) << 23;
+      if (exp == (0x7c00 << 13)) {
+        // Inf or NaN
+        f.u += (128 - 16) << 23;
+      } else if (exp == 0) {
+        // subnormal or zero: renormalize
+        FloatBits magic; magic.u = 113 << 23;
+        f.u += 1 << 23;
+        f.f -= magic.f;
+      }
+      f.u |= (uint32_t)(h & 0x8000) << 16;
+      return f.f;
+    }
+
+    // bfloat16 (upper half of single precision)
+    inline static uint16_t float_to_bfloat16(float x)
+    {
+      FloatBits f; f.f = x;
+      if ((f.u & 0x7fffffff) > 0x7f800000) {
+        // NaN: keep quiet
+        return (uint16_t)((f.u >> 16) | 0x40);
+      }
+      return (uint16_t)((f.u + 0x7fff + ((f.u >> 16) & 1)) >> 16);
+    }
+    inline static float bfloat16_to_float(uint16_t h)
+    {
+      FloatBits f;
+      f.u = (uint32_t)h << 16;
+      return f.f;
+    }
+
+    // Complex multiply-accumulate with the second operand in a 16 bit
+    // format, scaled by scale after conversion.
+    template <float (*convert)(uint16_t)>
+    inline static void cmac_hc_packed_f(float *dst, const float *src1, const uint16_t *src2, float scale, size_t n)
+    {
+      float d0 = dst[0] + src1[0] * convert(src2[0]) * scale;
+      float d4 = dst[4] + src1[4] * convert(src2[4]) * scale;
+      float c[8];
+
+      for (size_t i = 0; i < n; i += 8) {
+        for (size_t j = 0; j < 8; ++j)
+          c[j] = convert(src2[i+j]) * scale;
+        
+        dst[i+0] += src1[i+0] * c[0] - src1[i+4] * c[4];
+        dst[i+1] += src1[i+1] * c[1] - src1[i+5] * c[5];
+        dst[i+2] += src1[i+2] * c[2] - src1[i+6] * c[6];
+        dst[i+3] += src1[i+3] * c[3] - src1[i+7] * c[7];
+
+        dst[i+4] += src1[i+0] * c[4] + src1[i+4] * c[0];
+        dst[i+5] += src1[i+1] * c[5] + src1[i+5] * c[1];
+        dst[i+6] += src1[i+2] * c[6] + src1[i+6] * c[2];
+        dst[i+7] += src1[i+3] * c[7] + src1[i+7] * c[3];
+      }
+
+      dst[0] = d0;
+      dst[4] = d4;
+    }
+
+    inline static void cmac_hc_f16_f(float *dst, const float *src1, const uint16_t *src2, float scale, size_t n)
+    {
+      cmac_hc_packed_f<half_to_float>(dst, src1, src2, scale, n);
+    }
+    inline static void cmac_hc_bf16_f(float *dst, const float *src1, const uint16_t *src2, size_t n)
+    {
+      cmac_hc_packed_f<bfloat16_to_float>(dst, src1, src2, 1.f, n);
+    }
   
 #if defined(__ALTIVEC__)
 
@@ -91,6 +213,11 @@ namespace VEP
     		}
   	  }
     }
+
+    inline static void axpy(float* dst, float a, const float* src, size_t n)
+    {
+      axpy_f(dst, a, src, n);
+    }
   
     inline static void cmac_hc(float *dst, const float *src1, const float *src2, size_t n)
     {
@@ -134,6 +261,17 @@ namespace VEP
   			dst += 4; src += 4;
   		}
     }
+
+    // dst += a * src (unaligned)
+    inline static void axpy(float* dst, float a, const float* src, size_t n)
+    {
+      const vfloat32 va = _mm_set1_ps(a);
+      for (; n >= 4; n -= 4) {
+        _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_mul_ps(va, _mm_loadu_ps(src))));
+        dst += 4; src += 4;
+      }
+      axpy_f(dst, a, src, n);
+    }
   
     inline static void cmac_hc(float *dst, const float *src1, const float *src2, size_t n)
     {
@@ -159,11 +297,86 @@ namespace VEP
       dst[4] = d4;
     }
 
+# if defined(__F16C__)
+
+    inline static void cmac_hc_f16(float *dst, const float *src1, const uint16_t *src2, float scale, size_t n)
+    {
+      vfloat32 *vsrc1 = (vfloat32*)src1;
+      vfloat32 *vdst  = (vfloat32*)dst;
+      const __m128i *hsrc2 = (const __m128i*)src2;
+      const vfloat32 vscale = _mm_set1_ps(scale);
+
+      float d0 = dst[0] + src1[0] * half_to_float(src2[0]) * scale;
+      float d4 = dst[4] + src1[4] * half_to_float(src2[4]) * scale;
+
+      for (size_t i=0; i < n>>2; i += 2) {
+        // convert eight half precision values in registers
+        __m128i   h    = _mm_load_si128(hsrc2 + (i>>1));
+        vfloat32 c0_a = *(vsrc1+i+0);
+        vfloat32 c0_b = *(vsrc1+i+1);
+        vfloat32 c1_a = _mm_mul_ps(_mm_cvtph_ps(h), vscale);
+        vfloat32 c1_b = _mm_mul_ps(_mm_cvtph_ps(_mm_unpackhi_epi64(h, h)), vscale);
+        vfloat32 cd_a = *( vdst+i+0);
+        vfloat32 cd_b = *( vdst+i+1);
+        *(vdst+i+0) = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(c0_a, c1_a), _mm_mul_ps(c0_b, c1_b)), cd_a);
+        *(vdst+i+1) = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0_b, c1_a), _mm_mul_ps(c0_a, c1_b)), cd_b);
+      }
+
+      dst[0] = d0;
+      dst[4] = d4;
+    }
+# else // !__F16C__
+    inline static void cmac_hc_f16(float *dst, const float *src1, const uint16_t *src2, float scale, size_t n)
+    {
+      cmac_hc_f16_f(dst, src1, src2, scale, n);
+    }
+# endif // __F16C__
+
+# if defined(__SSE2__)
+
+    inline static void cmac_hc_bf16(float *dst, const float *src1, const uint16_t *src2, size_t n)
+    {
+      vfloat32 *vsrc1 = (vfloat32*)src1;
+      vfloat32 *vdst  = (vfloat32*)dst;
+      const __m128i *hsrc2 = (const __m128i*)src2;
+      const __m128i vzero = _mm_setzero_si128();
+
+      float d0 = dst[0] + src1[0] * bfloat16_to_float(src2[0]);
+      float d4 = dst[4] + src1[4] * bfloat16_to_float(src2[4]);
+
+      for (size_t i=0; i < n>>2; i += 2) {
+        // bfloat16 to float: interleave with zero low halves
+        __m128i   h    = _mm_load_si128(hsrc2 + (i>>1));
+        vfloat32 c0_a = *(vsrc1+i+0);
+        vfloat32 c0_b = *(vsrc1+i+1);
+        vfloat32 c1_a = _mm_castsi128_ps(_mm_unpacklo_epi16(vzero, h));
+        vfloat32 c1_b = _mm_castsi128_ps(_mm_unpackhi_epi16(vzero, h));
+        vfloat32 cd_a = *( vdst+i+0);
+        vfloat32 cd_b = *( vdst+i+1);
+        *(vdst+i+0) = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(c0_a, c1_a), _mm_mul_ps(c0_b, c1_b)), cd_a);
+        *(vdst+i+1) = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0_b, c1_a), _mm_mul_ps(c0_a, c1_b)), cd_b);
+      }
+
+      dst[0] = d0;
+      dst[4] = d4;
+    }
+# else // !__SSE2__
+    inline static void cmac_hc_bf16(float *dst, const float *src1, const uint16_t *src2, size_t n)
+    {
+      cmac_hc_bf16_f(dst, src1, src2, n);
+    }
+# endif // __SSE2__
+
 #else // !(ALTIVEC || SSE)
     inline static void mix(float* dst, const float* src, size_t n)
     {
       mix_f(dst, src, n);
     }
+
+    inline static void axpy(float* dst, float a, const float* src, size_t n)
+    {
+      axpy_f(dst, a, src, n);
+    }
   
     inline static void cmac_hc(float *dst, const float *src1, const float *src2, size_t n)
     {
@@ -171,6 +384,17 @@ namespace VEP
     }
 #endif
 
+#if !defined(__SSE__)
+    inline static void cmac_hc_f16(float *dst, const float *src1, const uint16_t *src2, float scale, size_t n)
+    {
+      cmac_hc_f16_f(dst, src1, src2, scale, n);
+    }
+    inline static void cmac_hc_bf16(float *dst, const float *src1, const uint16_t *src2, size_t n)
+    {
+      cmac_hc_bf16_f(dst, src1, src2, n);
+    }
+#endif
+
   }; // namespace DSP
 }; // namespace VEP
 
@@ -0,0 +1,194 @@
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#include "VEPDecoder.h"
+#include "VEPDSP.h"
+
+#include <math.h>
+
+using namespace VEP;
+
+namespace
+{
+  // maximum position difference of mirrored speakers (degrees)
+  const float kAngleTolerance = 1.f;
+  // maximum energy of the difference between mirrored HRIRs relative
+  // to their energy (-30 dB)
+  const double kSymmetryTolerance = 1e-3;
+
+  // azimuth in [-180, 180)
+  inline float wrapAzimuth(float x)
+  {
+    x = fmodf(x + 180.f, 360.f);
+    if (x < 0.f) x += 360.f;
+    return x - 180.f;
+  }
+
+  inline bool isMedian(const BinauralDecoder::Speaker& s)
+  {
+    const float az = fabsf(wrapAzimuth(s.azimuth));
+    return (az < kAngleTolerance) || (az > 180.f - kAngleTolerance);
+  }
+};
+
+BinauralDecoder::BinauralDecoder(const std::vector<Speaker>& layout,
+                                 const float* hrir, size_t numFrames,
+                                 size_t minPartSize, size_t maxPartSize,
+                                 size_t blockSize, double sampleRate,
+                                 const Convolution::Options& options)
+  : m_numSpeakers(layout.size()),
+    m_numPairs(0),
+    m_routes(findRoutes(layout, hrir, numFrames)),
+    m_conv(0),
+    m_input(m_routes.size(), blockSize),
+    m_output(m_routes.size(), blockSize),
+    m_inputPtrs(m_input.begin(), m_input.end()),
+    m_outputPtrs(m_output.begin(), m_output.end())
+{
+  const size_t numRoutes = m_routes.size();
+  const size_t numHrirChannels = 2 * m_numSpeakers;
+
+  // transform one IR per route
+  std::vector<float> ir(numRoutes * numFrames);
+  for (size_t k=0; k < numRoutes; ++k) {
+    const Route& route = m_routes[k];
+    if (route.kind == kSide) m_numPairs++;
+    for (size_t i=0; i < numFrames; ++i) {
+      const float* h = hrir + i * numHrirChannels;
+      const float al = h[2*route.a], ar = h[2*route.a+1];
+      const float bl = h[2*route.b], br = h[2*route.b+1];
+      float x = 0.f;
+      switch (route.kind) {
+        case kLeft:   x = al; break;
+        case kRight:  x = ar; break;
+        case kMedian: x = 0.5f * (al + ar); break;
+        // mirrored HRIRs are averaged
+        case kMid:    x = 0.25f * ((al + br) + (ar + bl)); break;
+        case kSide:   x = 0.25f * ((al + br) - (ar + bl)); break;
+      }
+      ir[i * numRoutes + k] = x;
+    }
+  }
+
+  m_conv = new Convolution(Response(numRoutes, numFrames, minPartSize, maxPartSize), blockSize, sampleRate, options);
+  m_conv->setKernel(&ir[0], numRoutes, numFrames);
+}
+
+BinauralDecoder::~BinauralDecoder()
+{
+  delete m_conv;
+}
+
+bool BinauralDecoder::isMirrored(const Speaker& a, const Speaker& b)
+{
+  return (fabsf(wrapAzimuth(a.azimuth + b.azimuth)) < kAngleTolerance)
+      && (fabsf(a.elevation - b.elevation) < kAngleTolerance);
+}
+
+bool BinauralDecoder::isSymmetric(const float* hrir, size_t numSpeakers, size_t numFrames, size_t a, size_t b)
+{
+  const size_t numChannels = 2 * numSpeakers;
+  double e = 0., s = 0.;
+  for (size_t i=0; i < numFrames; ++i) {
+    const float* h = hrir + i * numChannels;
+    const double dl = h[2*a] - h[2*b+1];
+    const double dr = h[2*a+1] - h[2*b];
+    e += dl * dl + dr * dr;
+    s += h[2*a] * h[2*a] + h[2*a+1] * h[2*a+1] + h[2*b] * h[2*b] + h[2*b+1] * h[2*b+1];
+  }
+  return e <= kSymmetryTolerance * 0.5 * s;
+}
+
+std::vector<BinauralDecoder::Route> BinauralDecoder::findRoutes(const std::vector<Speaker>& layout, const float* hrir, size_t numFrames)
+{
+  const size_t n = layout.size();
+  std::vector<Route> routes;
+  std::vector<bool> done(n, false);
+
+  for (size_t i=0; i < n; ++i) {
+    if (done[i]) continue;
+    done[i] = true;
+    if (isMedian(layout[i]) && isSymmetric(hrir, n, numFrames, i, i)) {
+      routes.push_back(Route(kMedian, i, i));
+      continue;
+    }
+    size_t j = i + 1;
+    while ((j < n) && (done[j] || !isMirrored(layout[i], layout[j]) || !isSymmetric(hrir, n, numFrames, i, j)))
+      j++;
+    if (j < n) {
+      done[j] = true;
+      routes.push_back(Route(kMid, i, j));
+      routes.push_back(Route(kSide, i, j));
+    } else {
+      routes.push_back(Route(kLeft, i, i));
+      routes.push_back(Route(kRight, i, i));
+    }
+  }
+
+  return routes;
+}
+
+void BinauralDecoder::process(float** dst, const float** src, size_t numSpeakers, size_t numFrames)
+{
+  assert( numSpeakers == m_numSpeakers );
+
+  const size_t numRoutes = m_routes.size();
+
+  for (size_t k=0; k < numRoutes; ++k) {
+    const Route& route = m_routes[k];
+    float* in = m_input[k];
+    const float* a = src[route.a];
+    const float* b = src[route.b];
+    switch (route.kind) {
+      case kMid:
+        for (size_t i=0; i < numFrames; ++i) in[i] = a[i] + b[i];
+        break;
+      case kSide:
+        for (size_t i=0; i < numFrames; ++i) in[i] = a[i] - b[i];
+        break;
+      default:
+        memCopy(in, a, numFrames);
+        break;
+    }
+  }
+
+  m_conv->process(&m_outputPtrs[0], const_cast<const float**>(&m_inputPtrs[0]), numRoutes, numFrames);
+
+  memZero(dst[0], numFrames);
+  memZero(dst[1], numFrames);
+  for (size_t k=0; k < numRoutes; ++k) {
+    const float* out = m_output[k];
+    switch (m_routes[k].kind) {
+      case kLeft:
+        DSP::mix_f(dst[0], out, numFrames);
+        break;
+      case kRight:
+        DSP::mix_f(dst[1], out, numFrames);
+        break;
+      case kSide:
+        DSP::mix_f(dst[0], out, numFrames);
+        DSP::axpy(dst[1], -1.f, out, numFrames);
+        break;
+      default:
+        DSP::mix_f(dst[0], out, numFrames);
+        DSP::mix_f(dst[1], out, numFrames);
+        break;
+    }
+  }
+}
@@ -0,0 +1,110 @@
+// -*- c++ -*-
+//
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#ifndef VEP_DECODER_H_INCLUDED
+#define VEP_DECODER_H_INCLUDED
+
+#include "VEP.h"
+#include "VEPBuffer.h"
+#include "VEPConv.h"
+
+#include <vector>
+
+namespace VEP
+{
+  // =====================================================================
+  // VEP::BinauralDecoder
+  //
+  // Renders the feeds of virtual loudspeakers to two ears. Speakers
+  // mirrored about the median plane whose HRIRs are left/right
+  // symmetric are convolved as a pair: the sum of both feeds with the
+  // mid HRIR (l + r)/2 and their difference with the side HRIR
+  // (l - r)/2, which both ears share, so a pair needs two convolutions
+  // instead of four. Speakers on the median plane with equal HRIRs need
+  // one.
+
+  class BinauralDecoder
+  {
+  public:
+    // position in degrees; positive azimuths are to the left
+    struct Speaker
+    {
+      float azimuth;
+      float elevation;
+    };
+
+    // hrir holds two channels (left and right ear) per speaker
+    BinauralDecoder(const std::vector<Speaker>& layout,
+                    const float* hrir, size_t numFrames,
+                    size_t minPartSize, size_t maxPartSize,
+                    size_t blockSize, double sampleRate,
+                    const Convolution::Options& options=Convolution::Options());
+    ~BinauralDecoder();
+
+    size_t numSpeakers() const { return m_numSpeakers; }
+    // number of symmetric pairs
+    size_t numPairs() const { return m_numPairs; }
+    // number of convolved channels
+    size_t numConvolutions() const { return m_routes.size(); }
+    const Convolution& convolution() const { return *m_conv; }
+
+    // PRE: dst has two channels, numFrames <= blockSize
+    void process(float** dst, const float** src, size_t numSpeakers, size_t numFrames);
+
+  protected:
+    // convolved channel
+    enum RouteKind
+    {
+      kLeft,      // speaker a to the left ear
+      kRight,     // speaker a to the right ear
+      kMedian,    // speaker a to both ears
+      kMid,       // a + b to both ears
+      kSide       // a - b to the left ear, inverted to the right
+    };
+    struct Route
+    {
+      Route(RouteKind kind_, size_t a_, size_t b_)
+        : kind(kind_), a(a_), b(b_)
+      { }
+      RouteKind kind;
+      size_t    a;
+      size_t    b;
+    };
+
+    // true if speakers a and b are mirror images
+    static bool isMirrored(const Speaker& a, const Speaker& b);
+    // true if the HRIRs of speaker a mirrored equal those of speaker b
+    static bool isSymmetric(const float* hrir, size_t numSpeakers, size_t numFrames, size_t a, size_t b);
+    static std::vector<Route> findRoutes(const std::vector<Speaker>& layout, const float* hrir, size_t numFrames);
+
+  private:
+    size_t              m_numSpeakers;
+    size_t              m_numPairs;
+    std::vector<Route>  m_routes;
+    Convolution*        m_conv;
+    AudioBuffer         m_input;
+    AudioBuffer         m_output;
+    std::vector<float*> m_inputPtrs;
+    std::vector<float*> m_outputPtrs;
+  };
+};
+
+#endif // VEP_DECODER_H_INCLUDED
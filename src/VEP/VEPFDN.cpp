@@ -0,0 +1,307 @@
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#include "VEPFDN.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE__)
+# include <xmmintrin.h>
+#endif
+
+using namespace VEP;
+
+namespace
+{
+  // mutually prime delay line lengths at 48 kHz (21 to 58 ms)
+  const size_t kLineLength[FDN::kNumLines] = {
+    1031, 1327, 1523, 1871, 2053, 2311, 2539, 2803
+  };
+
+  // band edges of the decay fit
+  const double kLowBandCutoff = 500.;
+  const double kHighBandCutoff = 4000.;
+  // frequencies at which the absorption filters match the band decays
+  const double kLowBandFreq = 250.;
+  const double kHighBandFreq = 8000.;
+  // EDC range used for the decay fit (dB)
+  const double kFitBegin = -5.;
+  const double kFitEnd = -25.;
+  // EDC decimation of the decay fit
+  const size_t kFitHop = 16;
+  // decay time limits (seconds)
+  const double kMinDecay = 0.05;
+  const double kMaxDecay = 60.;
+
+  inline size_t lineLength(size_t i, double sampleRate)
+  {
+    return std::max((size_t)1, (size_t)(kLineLength[i] * sampleRate / 48000. + .5));
+  }
+
+  // feedback gain of a line of length frames for decay time seconds
+  inline double decayGain(size_t length, double decay, double sampleRate)
+  {
+    return decay > 0. ? pow(10., -3. * length / (decay * sampleRate)) : 0.;
+  }
+
+#if defined(__SSE__)
+  // 4 point Hadamard transform (unnormalized)
+  inline __m128 hadamard4(__m128 x)
+  {
+    __m128 p = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 q = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 1, 1));
+    x = _mm_add_ps(p, _mm_mul_ps(q, _mm_set_ps(-1.f, 1.f, -1.f, 1.f)));
+    p = _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 1, 0));
+    q = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 2, 3, 2));
+    return _mm_add_ps(p, _mm_mul_ps(q, _mm_set_ps(-1.f, -1.f, 1.f, 1.f)));
+  }
+#else
+  inline void hadamard4(float* x)
+  {
+    const float y0 = x[0] + x[1], y1 = x[0] - x[1];
+    const float y2 = x[2] + x[3], y3 = x[2] - x[3];
+    x[0] = y0 + y2; x[1] = y1 + y3;
+    x[2] = y0 - y2; x[3] = y1 - y3;
+  }
+#endif
+
+  // decay time of an energy decay curve from a linear fit of its level
+  // between kFitBegin and kFitEnd; edc(i) is evaluated by the caller
+  struct DecayFit
+  {
+    DecayFit()
+      : sx(0.), sy(0.), sxx(0.), sxy(0.), n(0)
+    { }
+    void add(double t, double level)
+    {
+      if ((level > kFitBegin) || (level < kFitEnd)) return;
+      sx += t; sy += level; sxx += t * t; sxy += t * level;
+      n++;
+    }
+    double decay() const
+    {
+      if (n < 2) return 0.;
+      const double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+      if (!(slope < 0.)) return 0.;
+      return std::min(kMaxDecay, std::max(kMinDecay, -60. / slope));
+    }
+    double sx, sy, sxx, sxy;
+    size_t n;
+  };
+};
+
+FDN::FDN(double sampleRate, size_t preDelay)
+  : m_sampleRate(sampleRate),
+    m_gain(0.f),
+    m_decayLow(0.),
+    m_decayHigh(0.),
+    m_preDelay(preDelay, 0.f),
+    m_preDelayPos(0)
+{
+  for (size_t i=0; i < kNumLines; ++i) {
+    m_length[i] = lineLength(i, sampleRate);
+    m_b[i] = m_a[i] = 0.f;
+  }
+  initState(m_state, m_buffer);
+  initState(m_scratch, m_scratchBuffer);
+}
+
+size_t FDN::fadeLength(double sampleRate)
+{
+  return lineLength(kNumLines - 1, sampleRate);
+}
+
+void FDN::initState(State& state, std::vector<float>& buffer)
+{
+  size_t size = 0;
+  for (size_t i=0; i < kNumLines; ++i) size += m_length[i];
+  buffer.resize(size);
+  size = 0;
+  for (size_t i=0; i < kNumLines; ++i) {
+    state.line[i] = &buffer[size];
+    size += m_length[i];
+  }
+  clearState(state);
+}
+
+void FDN::clearState(State& state)
+{
+  for (size_t i=0; i < kNumLines; ++i) {
+    std::fill(state.line[i], state.line[i] + m_length[i], 0.f);
+    state.pos[i] = 0;
+    state.filter[i] = 0.f;
+  }
+}
+
+void FDN::setDecay(double decayLow, double decayHigh)
+{
+  // one-pole absorption filter b / (1 - a z^-1) per line with gain kl
+  // at wl and kh at wh. With D(w) = 1 - 2a cos(w) + a^2 and
+  // r = (kl/kh)^2, D(wh) = r D(wl) gives a^2 - 2ca + 1 = 0 where
+  // c = (cos(wh) - r cos(wl)) / (1 - r).
+  m_decayLow = decayLow;
+  m_decayHigh = decayHigh;
+  const double wl = 2. * M_PI * kLowBandFreq / m_sampleRate;
+  const double wh = 2. * M_PI * std::min(kHighBandFreq, 0.4 * m_sampleRate) / m_sampleRate;
+  for (size_t i=0; i < kNumLines; ++i) {
+    const double kl = decayGain(m_length[i], decayLow, m_sampleRate);
+    const double kh = decayGain(m_length[i], decayHigh, m_sampleRate);
+    double a = 0.;
+    if ((kl > 0.) && (kh > 0.) && (kl != kh)) {
+      const double r = (kl * kl) / (kh * kh);
+      const double c = (cos(wh) - r * cos(wl)) / (1. - r);
+      // the root inside the unit circle; ratios beyond what a single
+      // pole can do are clipped
+      a = fabs(c) > 1. ? c - (c > 0. ? 1. : -1.) * sqrt(c * c - 1.) : (r > 1. ? 1. : -1.);
+      a = std::min(0.99, std::max(-0.99, a));
+    }
+    // keep the loop gain below unity at all frequencies
+    const double b = std::min(kl * sqrt(1. - 2. * a * cos(wl) + a * a), 0.999 * (1. - fabs(a)));
+    m_a[i] = (float)a;
+    m_b[i] = (float)b;
+  }
+}
+
+inline float FDN::tick(State& state, float x)
+{
+  const float norm = 0.35355339f; // 1/sqrt(8)
+  float y[kNumLines];
+  for (size_t i=0; i < kNumLines; ++i) {
+    y[i] = state.line[i][state.pos[i]];
+  }
+#if defined(__SSE__)
+  // absorption
+  __m128 y0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m_b), _mm_loadu_ps(y)),
+                         _mm_mul_ps(_mm_loadu_ps(m_a), _mm_loadu_ps(state.filter)));
+  __m128 y1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m_b + 4), _mm_loadu_ps(y + 4)),
+                         _mm_mul_ps(_mm_loadu_ps(m_a + 4), _mm_loadu_ps(state.filter + 4)));
+  _mm_storeu_ps(state.filter, y0);
+  _mm_storeu_ps(state.filter + 4, y1);
+  // output: lines with alternating signs
+  const __m128 sign = _mm_set_ps(-1.f, 1.f, -1.f, 1.f);
+  _mm_storeu_ps(y, _mm_mul_ps(_mm_add_ps(y0, y1), sign));
+  const float out = (y[0] + y[1]) + (y[2] + y[3]);
+  // feedback: H8 = [H4 H4; H4 -H4] plus input
+  const __m128 in = _mm_set1_ps(x);
+  const __m128 scale = _mm_set1_ps(norm);
+  _mm_storeu_ps(y, _mm_add_ps(_mm_mul_ps(hadamard4(_mm_add_ps(y0, y1)), scale), in));
+  _mm_storeu_ps(y + 4, _mm_add_ps(_mm_mul_ps(hadamard4(_mm_sub_ps(y0, y1)), scale), in));
+#else
+  float out = 0.f;
+  for (size_t i=0; i < kNumLines; ++i) {
+    state.filter[i] = m_b[i] * y[i] + m_a[i] * state.filter[i];
+    out += (i & 1) ? -state.filter[i] : state.filter[i];
+  }
+  for (size_t i=0; i < 4; ++i) {
+    y[i] = state.filter[i] + state.filter[i+4];
+    y[i+4] = state.filter[i] - state.filter[i+4];
+  }
+  hadamard4(y);
+  hadamard4(y + 4);
+  for (size_t i=0; i < kNumLines; ++i) {
+    y[i] = y[i] * norm + x;
+  }
+#endif
+  for (size_t i=0; i < kNumLines; ++i) {
+    state.line[i][state.pos[i]] = y[i];
+    if (++state.pos[i] == m_length[i]) state.pos[i] = 0;
+  }
+  return out;
+}
+
+void FDN::process(float* dst, const float* src, size_t numFrames)
+{
+  const size_t preDelay = m_preDelay.size();
+  for (size_t i=0; i < numFrames; ++i) {
+    float x = src[i];
+    if (preDelay > 0) {
+      float& d = m_preDelay[m_preDelayPos];
+      const float y = d;
+      d = x;
+      x = y;
+      if (++m_preDelayPos == preDelay) m_preDelayPos = 0;
+    }
+    dst[i] += m_gain * tick(m_state, x);
+  }
+}
+
+double FDN::impulseEnergy(size_t begin, size_t end)
+{
+  clearState(m_scratch);
+  double energy = 0.;
+  for (size_t i=0; i < end; ++i) {
+    const float y = tick(m_scratch, i == 0 ? 1.f : 0.f);
+    if (i >= begin) energy += y * y;
+  }
+  return energy;
+}
+
+bool FDN::fitDecay(const float* data, size_t numChannels, size_t channel,
+                   size_t begin, size_t end, double sampleRate,
+                   double& decayLow, double& decayHigh)
+{
+  // the EDC is the total energy minus the energy up to a frame, so the
+  // band filters run twice instead of storing the band signals; the
+  // bands are split by two one-pole stages each, so that the slower
+  // band doesn't dominate the late EDC of the other
+  decayLow = decayHigh = 0.;
+  if (end <= begin) return false;
+
+  const size_t warmup = std::min(begin, (size_t)(sampleRate * 0.01));
+  const double cLow = 1. - exp(-2. * M_PI * kLowBandCutoff / sampleRate);
+  const double cHigh = 1. - exp(-2. * M_PI * kHighBandCutoff / sampleRate);
+
+  double totalLow = 0., totalHigh = 0.;
+  DecayFit fitLow, fitHigh;
+
+  for (int pass=0; pass < 2; ++pass) {
+    double low1 = 0., low = 0., smooth1 = 0., smooth2 = 0.;
+    double sumLow = 0., sumHigh = 0.;
+    for (size_t t=begin-warmup; t < end; ++t) {
+      const double x = data[t * numChannels + channel];
+      low1 += cLow * (x - low1);
+      low += cLow * (low1 - low);
+      smooth1 += cHigh * (x - smooth1);
+      const double high1 = x - smooth1;
+      smooth2 += cHigh * (high1 - smooth2);
+      if (t < begin) continue;
+      const double high = high1 - smooth2;
+      if ((pass == 1) && (((t - begin) % kFitHop) == 0)) {
+        const double edcLow = totalLow - sumLow;
+        const double edcHigh = totalHigh - sumHigh;
+        const double time = (t - begin) / sampleRate;
+        if (edcLow > 0.) fitLow.add(time, 10. * log10(edcLow / totalLow));
+        if (edcHigh > 0.) fitHigh.add(time, 10. * log10(edcHigh / totalHigh));
+      }
+      sumLow += low * low;
+      sumHigh += high * high;
+    }
+    totalLow = sumLow;
+    totalHigh = sumHigh;
+    if ((totalLow <= 0.) && (totalHigh <= 0.)) return false;
+  }
+
+  decayLow = fitLow.decay();
+  decayHigh = fitHigh.decay();
+  // a band without decay takes that of the other band
+  if (decayLow == 0.) decayLow = decayHigh;
+  if (decayHigh == 0.) decayHigh = decayLow;
+  return decayLow > 0.;
+}
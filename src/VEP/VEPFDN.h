@@ -0,0 +1,104 @@
+// -*- c++ -*-
+//
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#ifndef VEP_FDN_H_INCLUDED
+#define VEP_FDN_H_INCLUDED
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace VEP
+{
+  // =====================================================================
+  // VEP::FDN
+  //
+  // Feedback delay network rendering the diffuse tail of one IR channel.
+  // Eight delay lines are mixed by a Hadamard matrix (four lines per SSE
+  // vector); one-pole absorption filters in each line set the decay time
+  // in a low and a high band. The input is pre-delayed, so that the
+  // response of the network starts at the tail cutoff.
+
+  class FDN
+  {
+  public:
+    enum { kNumLines = 8 };
+
+    FDN(double sampleRate, size_t preDelay);
+
+    // length of the longest delay line; the convolved IR is faded out
+    // over this many frames after the cutoff
+    static size_t fadeLength(double sampleRate);
+
+    size_t preDelay() const { return m_preDelay.size(); }
+    // decay time (-60 dB) in seconds in the low and the high band
+    double decayLow() const { return m_decayLow; }
+    double decayHigh() const { return m_decayHigh; }
+    void setDecay(double decayLow, double decayHigh);
+    float gain() const { return m_gain; }
+    void setGain(float gain) { m_gain = gain; }
+
+    // dst += tail of src
+    void process(float* dst, const float* src, size_t numFrames);
+
+    // energy of the impulse response without pre-delay between frames
+    // begin and end; doesn't touch the processing state
+    double impulseEnergy(size_t begin, size_t end);
+
+    // estimate decay times of channel of an interleaved IR between
+    // frames begin and end from the energy decay curves of a low and a
+    // high band; return false if there's no usable decay
+    static bool fitDecay(const float* data, size_t numChannels, size_t channel,
+                         size_t begin, size_t end, double sampleRate,
+                         double& decayLow, double& decayHigh);
+
+  protected:
+    struct State
+    {
+      float*  line[kNumLines];
+      size_t  pos[kNumLines];
+      float   filter[kNumLines];
+    };
+    void initState(State& state, std::vector<float>& buffer);
+    void clearState(State& state);
+    // one frame of the network, without gain
+    float tick(State& state, float x);
+
+  private:
+    double              m_sampleRate;
+    size_t              m_length[kNumLines];
+    // absorption filters y = b x + a y'
+    float               m_b[kNumLines];
+    float               m_a[kNumLines];
+    float               m_gain;
+    double              m_decayLow;
+    double              m_decayHigh;
+    std::vector<float>  m_preDelay;
+    size_t              m_preDelayPos;
+    std::vector<float>  m_buffer;
+    State               m_state;
+    // impulse response measurement
+    std::vector<float>  m_scratchBuffer;
+    State               m_scratch;
+  };
+};
+
+#endif // VEP_FDN_H_INCLUDED
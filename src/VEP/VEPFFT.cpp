@@ -20,15 +20,16 @@
 #include "VEPFFT.h"
 #include "VEP.h"
 
+#include "clz.h"
+
 #include <vector>
 
 #define VEP_FFT_DEBUG 0
 
 using namespace VEP;
 
-FFT::FFT(size_t logSize, bool measure)
-  : m_logSize(logSize),
-    m_size(1<<logSize),
+FFT::FFT(size_t size, bool measure)
+  : m_size(size),
     m_paddedSize(m_size<<1),
     m_norm(1./double(m_paddedSize))
 {
@@ -50,14 +51,58 @@ FFT::FFT(size_t logSize, bool measure)
 #endif // VEP_FFT_DEBUG
 }
 
-FFT* FFT::get(size_t logSize, bool measure)
+// index of radix factor in kFactors
+static const size_t kNumFactors = 3;
+static const size_t kFactors[kNumFactors] = { 1, 3, 5 };
+
+static bool splitSize(size_t size, size_t& factorIndex, size_t& logSize)
+{
+  for (factorIndex = 0; factorIndex < kNumFactors; ++factorIndex) {
+    const size_t f = kFactors[factorIndex];
+    if ((size % f) == 0) {
+      const size_t p = size / f;
+      if ((p >= 4) && ISPOWEROFTWO(p)) {
+        logSize = LOG2CEIL(p);
+        return logSize <= FFT::kMaxLogSize;
+      }
+    }
+  }
+  return false;
+}
+
+bool FFT::isValidSize(size_t size)
+{
+  size_t factorIndex, logSize;
+  return splitSize(size, factorIndex, logSize);
+}
+
+size_t FFT::nextValidSize(size_t size)
+{
+  size_t best = 0;
+  for (size_t i = 0; i < kNumFactors; ++i) {
+    const size_t f = kFactors[i];
+    size_t n = f * 4;
+    while ((n < size) && (n < (f << kMaxLogSize))) n <<= 1;
+    if ((n >= size) && ((best == 0) || (n < best))) best = n;
+  }
+  return best;
+}
+
+size_t FFT::factor(size_t size)
+{
+  size_t factorIndex, logSize;
+  return splitSize(size, factorIndex, logSize) ? kFactors[factorIndex] : 0;
+}
+
+FFT* FFT::get(size_t size, bool measure)
 {
-  static FFT* gFFT[kMaxLogSize+1];
-  if (logSize > kMaxLogSize)
+  static FFT* gFFT[kNumFactors][kMaxLogSize+1];
+  size_t factorIndex, logSize;
+  if (!splitSize(size, factorIndex, logSize))
     return 0;
-  if (gFFT[logSize] == 0)
-    gFFT[logSize] = new FFT(logSize, measure);
-  return gFFT[logSize];
+  if (gFFT[factorIndex][logSize] == 0)
+    gFFT[factorIndex][logSize] = new FFT(size, measure);
+  return gFFT[factorIndex][logSize];
 }
 
 // EOF
@@ -35,16 +35,24 @@ namespace VEP
     
   public:
     // shuffle data from HC format in src to dst in SIMD format
-    // PRE: ISPOWEROFTWO(N) and N >= 8
+    // PRE: (N % 8) == 0
     static inline void shufflehc(float *dst, const float *src, size_t N);
     // unshuffle data from SIMD format in src to dst in HC format
-    // PRE: ISPOWEROFTWO(N) and N >= 8
+    // PRE: (N % 8) == 0
     static inline void unshufflehc(float *dst, const float *src, size_t N);
 
-    static FFT* get(size_t logSize, bool measure);
+    // return true if FFTs of (unpadded) size are supported, i.e. size
+    // is one of 2^n, 3*2^n or 5*2^n, n >= 2 and size <= 5*2^kMaxLogSize
+    static bool isValidSize(size_t size);
+    // return smallest valid size >= size (or 0 if there is none)
+    static size_t nextValidSize(size_t size);
+    // return the radix factor (1, 3 or 5) of a valid size
+    static size_t factor(size_t size);
+
+    // return FFT object for (unpadded) size or 0 if size is not valid
+    static FFT* get(size_t size, bool measure);
     
   public:
-    size_t logSize() const { return m_logSize; }
     size_t size() const { return m_size; }
     size_t paddedSize() const { return m_paddedSize; }
     double norm() const { return m_norm; }
@@ -56,16 +64,15 @@ namespace VEP
     inline void execute_backward_hc(float *io) const;
 
   private:
-    FFT(size_t logSize, bool measure);
+    FFT(size_t size, bool measure);
     ~FFT();
 
   private:
-    size_t                m_logSize;      // FFT log size
-    size_t                m_size;         // FFT size (2^logSize)
+    size_t                m_size;         // FFT size (f*2^n)
     size_t                m_paddedSize;   // FFT size * 2
     fftwf_plan            m_planF;        // forward plan (real -> complex)
     fftwf_plan            m_planB;        // backward plan (complex -> real)
-    double                m_norm;         // normalization factor (1/sqrt(N))
+    double                m_norm;         // normalization factor (1/N)
   };
 
   template <class T> static T* memAlloc(size_t n)
@@ -0,0 +1,165 @@
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#include "VEPPerf.h"
+
+#include <string.h>
+
+#if VEP_BENCHMARK && defined(SC_LINUX)
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+using namespace VEP;
+
+#if VEP_BENCHMARK
+# if defined(SC_LINUX)
+
+namespace
+{
+  const uint64_t kConfig[Perf::kNumCounters] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,             // last level cache
+    PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+  };
+
+  // per thread counter group
+  struct CounterGroup
+  {
+    bool  initialized;
+    int   leader;
+    int   numOpen;
+    int   index[Perf::kNumCounters];   // position in group read, -1 if unavailable
+    int   fd[Perf::kNumCounters];
+  };
+
+  __thread CounterGroup tGroup;
+
+  int openCounter(uint64_t config, int group)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+  }
+
+  CounterGroup& threadGroup()
+  {
+    CounterGroup& g = tGroup;
+    if (!g.initialized) {
+      g.initialized = true;
+      g.leader = -1;
+      g.numOpen = 0;
+      for (int i=0; i < Perf::kNumCounters; ++i) {
+        const int fd = openCounter(kConfig[i], g.leader);
+        g.fd[i] = fd;
+        if (fd < 0) {
+          g.index[i] = -1;
+        } else {
+          if (g.leader < 0) g.leader = fd;
+          g.index[i] = g.numOpen++;
+        }
+      }
+    }
+    return g;
+  }
+};
+
+void VEP::Perf::read(uint64_t* values)
+{
+  CounterGroup& g = threadGroup();
+  // group read format: { nr, values[nr] }
+  uint64_t buffer[1 + kNumCounters];
+  if ((g.leader < 0) || (::read(g.leader, buffer, sizeof(buffer)) <= 0)) {
+    memset(values, 0, kNumCounters * sizeof(uint64_t));
+    return;
+  }
+  for (int i=0; i < kNumCounters; ++i) {
+    values[i] = g.index[i] >= 0 ? buffer[1 + g.index[i]] : 0;
+  }
+}
+
+bool VEP::Perf::isAvailable(Counter i)
+{
+  return threadGroup().index[i] >= 0;
+}
+
+void VEP::Perf::openThread()
+{
+  threadGroup();
+}
+
+void VEP::Perf::closeThread()
+{
+  CounterGroup& g = threadGroup();
+  // members first, then the leader
+  for (int i=kNumCounters; i > 0; --i) {
+    if (g.fd[i-1] >= 0) close(g.fd[i-1]);
+    g.fd[i-1] = -1;
+    g.index[i-1] = -1;
+  }
+  g.leader = -1;
+  g.numOpen = 0;
+}
+
+# else // !SC_LINUX
+
+void VEP::Perf::read(uint64_t* values)
+{
+  memset(values, 0, kNumCounters * sizeof(uint64_t));
+}
+
+bool VEP::Perf::isAvailable(Counter)
+{
+  return false;
+}
+
+void VEP::Perf::openThread()
+{
+}
+
+void VEP::Perf::closeThread()
+{
+}
+
+# endif // SC_LINUX
+#endif // VEP_BENCHMARK
+
+void VEP::Perf::print(FILE* stream, const char* tag, const Stats& stats, double perUnit)
+{
+  const double cycles = stats.avg(kCycles);
+  const double instructions = stats.avg(kInstructions);
+  fprintf(stream, " %s: n %llu cyc %.0f ins %.0f ipc %.2f llc %.1f stall %.0f%%",
+          tag,
+          (unsigned long long)stats.count,
+          cycles / perUnit,
+          instructions / perUnit,
+          cycles > 0. ? instructions / cycles : 0.,
+          stats.avg(kLLCMisses) / perUnit,
+          cycles > 0. ? 100. * stats.avg(kStalledCycles) / cycles : 0.);
+}
+
+// EOF
@@ -0,0 +1,114 @@
+// -*- c++ -*-
+//
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#ifndef VEP_PERF_H_INCLUDED
+#define VEP_PERF_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+// =====================================================================
+// VEP::Perf
+//
+// Hardware performance counters for the benchmark build (SCons option
+// BENCHMARK). Counters are read from the calling thread with Linux
+// perf_event_open and read as one group per thread. Worker threads
+// open their group when they start and close it before they exit;
+// other threads open it on the first read. Counters the CPU or kernel
+// doesn't provide read as zero and are reported as unavailable.
+
+namespace VEP
+{
+  namespace Perf
+  {
+    enum Counter
+    {
+      kCycles,
+      kInstructions,
+      kLLCMisses,
+      kStalledCycles,
+      kNumCounters
+    };
+
+    // accumulated counter deltas of a code section
+    struct Stats
+    {
+      Stats() { reset(); }
+      void reset()
+      {
+        count = 0;
+        for (int i=0; i < kNumCounters; ++i) value[i] = 0;
+      }
+      double avg(Counter i) const { return count ? (double)value[i] / (double)count : 0.; }
+
+      uint64_t count;
+      uint64_t value[kNumCounters];
+    };
+
+#if VEP_BENCHMARK
+    // read the counters of the calling thread
+    void read(uint64_t* values);
+    // true if counter i could be opened in the calling thread
+    bool isAvailable(Counter i);
+    // open the counters of the calling thread
+    void openThread();
+    // close the counters of the calling thread; later reads return zero
+    void closeThread();
+
+    // accumulate counter deltas of the enclosing scope
+    class Probe
+    {
+    public:
+      Probe(Stats& stats)
+        : m_stats(stats)
+      {
+        read(m_begin);
+      }
+      ~Probe()
+      {
+        uint64_t end[kNumCounters];
+        read(end);
+        for (int i=0; i < kNumCounters; ++i)
+          m_stats.value[i] += end[i] - m_begin[i];
+        m_stats.count++;
+      }
+    private:
+      Stats&    m_stats;
+      uint64_t  m_begin[kNumCounters];
+    };
+#endif // VEP_BENCHMARK
+
+    // print average counts per call of stats to stream
+    void print(FILE* stream, const char* tag, const Stats& stats, double perUnit=1.);
+  };
+};
+
+#if VEP_BENCHMARK
+# define VEP_PERF_PROBE(stats) VEP::Perf::Probe vepPerfProbe_(stats)
+# define VEP_PERF_THREAD_OPEN() VEP::Perf::openThread()
+# define VEP_PERF_THREAD_CLOSE() VEP::Perf::closeThread()
+#else
+# define VEP_PERF_PROBE(stats)
+# define VEP_PERF_THREAD_OPEN()
+# define VEP_PERF_THREAD_CLOSE()
+#endif
+
+#endif // VEP_PERF_H_INCLUDED
@@ -22,11 +22,14 @@
 #include <sndfile.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include "VEP.h"
 #include "VEPConv.h"
+#include "VEPDecoder.h"
 #include "VEPDSP.h"
+#include "VEPTrace.h"
 
 #include "clz.h"
 #include "SC_PlugIn.h"
@@ -66,10 +69,24 @@ struct VEPConvolution : public Unit
     idx_kernelSize,     // kernel frame count
     idx_minPartSize,    // minimum partition size
     idx_maxPartSize,    // maximum partition size
-    idx_numRTProcs,     // number of convolvers in RT thread
+    idx_numRTProcs,     // number of convolvers in RT thread (< 0: adaptive)
+    idx_maxRTLoad,      // adaptive mode: maximum RT load
+    idx_overloadPolicy, // 0: wait, 1: drop latest, 2: drop quietest
+    idx_kernelFormat,   // 0: float, 1: half precision, 2: bfloat16
+    idx_batch,          // batch id (0: none)
+    idx_tailCutoff,     // parametric tail after this time in seconds (0: off)
     kNumFixedInputs
   };
 
+  struct KernelRequest
+  {
+    int                 bufnum;
+    int                 offset;
+    int                 length;
+    bool                reload;
+  };
+  struct KernelLoader;
+
   struct Cmd
   {
     enum Type
@@ -80,18 +97,27 @@ struct VEPConvolution : public Unit
     };
     struct InitData
     {
+      int               blockSize;
+      double            sampleRate;
       int               numRTProcs;
+      float             maxRTLoad;
+      int               overloadPolicy;
+      int               kernelFormat;
+      int               batchId;
+      int               tailCutoff;
       VEP::Convolution* conv;
+      VEP::Batch*       batch;
     };
     struct ReleaseData
     {
       VEP::Convolution* conv;
+      VEP::Batch*       batch;
     };
     struct SetKernelData
     {
-      int               bufnum;
-      int               offset;
-      int               length;
+      KernelLoader*     loader;
+      VEP::Convolution::StagedKernel* staged;
+      bool              superseded;
     };
     union Data
     {
@@ -106,8 +132,34 @@ struct VEPConvolution : public Unit
     
   };
 
-  bool setKernel(int bufnum, int offset, int length, bool defer);
+  // Kernel requests are coalesced in a single slot: each request
+  // replaces the pending one and at most one load is in flight. The
+  // IR is transformed in the NRT stage and swapped in by the RT stage.
+  // Every request bumps the generation, so that the NRT stage skips a
+  // load that has been superseded before it starts transforming. The
+  // slot is only accessed in the RT thread. The loader and its command
+  // are allocated once; the loader outlives the unit while a load is
+  // in flight.
+  struct KernelLoader
+  {
+    VEPConvolution*     unit;           // 0 after the unit is gone
+    Cmd                 cmd;
+    KernelRequest       request;        // latest request
+    bool                pending;
+    bool                inFlight;
+    int                 loadedBufnum;
+    volatile unsigned   generation;     // number of requests
+    // load in flight
+    KernelRequest       loading;
+    unsigned            loadingGeneration;
+    VEP::Convolution*   conv;
+  };
+
+  void requestKernel(int bufnum, int offset, int length, bool reload);
+  void loadKernel();
+  void setKernel(int bufnum, bool reload, VEP::Convolution::StagedKernel* staged);
   void process(size_t numSamples);
+  void reportOverload(size_t numSamples);
 
   Cmd* allocCmd(Cmd::Type type);
   void doCmd(Cmd* cmd);
@@ -121,21 +173,73 @@ struct VEPConvolution : public Unit
   size_t                m_kernelMaxSize;
   size_t                m_minPartSize;
   size_t                m_maxPartSize;
-  size_t                m_numRTProcs;
   float                 m_bufnum;
   float                 m_buftrig;
   VEP::Convolution*     m_conv;
+  VEP::Batch*           m_batch;
+  KernelLoader*         m_kernelLoader;
+  // overload reporting
+  size_t                m_numShed;
+  size_t                m_numDropped;
+  size_t                m_reportHoldOff;
 #if VEP_BENCHMARK
   VEP::PeriodicBenchmark  m_bench;
 #endif
 
 };
 
+struct VEPBinauralDecoder : public Unit
+{
+  enum
+  {
+    idx_kernel,         // HRIR buffer number (left and right ear per speaker)
+    idx_layout,         // speaker layout buffer number (azimuth and elevation per speaker)
+    idx_minPartSize,    // minimum partition size
+    idx_maxPartSize,    // maximum partition size
+    idx_numRTProcs,     // number of convolvers in RT thread (< 0: adaptive)
+    kNumFixedInputs
+  };
+
+  // The init command only carries buffer numbers, the buffers are
+  // looked up again in the NRT stage. The unit clears the command's
+  // unit pointer if it's freed while the init is in flight; the
+  // decoder is then deleted in the last NRT stage.
+  struct Cmd
+  {
+    VEPBinauralDecoder*     unit;           // 0 after the unit is gone
+    bool                    release;
+    int                     kernelBufnum;
+    int                     layoutBufnum;
+    size_t                  numSpeakers;
+    int                     blockSize;
+    double                  sampleRate;
+    int                     minPartSize;
+    int                     maxPartSize;
+    int                     numRTProcs;
+    VEP::BinauralDecoder*   decoder;
+  };
+
+  Cmd* allocCmd(bool release);
+  void doCmd(Cmd* cmd);
+
+  static bool cmdStage2(World*, Cmd*);    // NRT
+  static bool cmdStage3(World*, Cmd*);    // RT
+  static bool cmdStage4(World*, Cmd*);    // NRT
+  static void cmdCleanup(World*, void*);  // RT
+
+  size_t                  m_numSpeakers;
+  VEP::BinauralDecoder*   m_decoder;
+  Cmd*                    m_initCmd;      // init in flight
+};
+
 extern "C"
 {
   void VEPConvolution_next(VEPConvolution*, int);
   void VEPConvolution_Ctor(VEPConvolution*);
   void VEPConvolution_Dtor(VEPConvolution*);
+  void VEPBinauralDecoder_next(VEPBinauralDecoder*, int);
+  void VEPBinauralDecoder_Ctor(VEPBinauralDecoder*);
+  void VEPBinauralDecoder_Dtor(VEPBinauralDecoder*);
   void load(InterfaceTable*);
 };
 
@@ -162,10 +266,14 @@ void VEPConvolution_Ctor(VEPConvolution *unit)
     }
   }
   
+  // NOTE: the partition size is independent of the server block size;
+  // VEP::Convolution re-blocks internally if necessary.
   int minPartSize = (int)VEPCONV_IN0(VEPConvolution::idx_minPartSize);
-  minPartSize = std::max(16, NEXTPOWEROFTWO(minPartSize > 0 ? minPartSize : BUFLENGTH));
+  // round up to the next supported FFT size (2^n, 3*2^n or 5*2^n)
+  minPartSize = (int)VEP::FFT::nextValidSize(std::max(16, minPartSize > 0 ? minPartSize : BUFLENGTH));
+  if (minPartSize == 0) minPartSize = 1 << VEP::FFT::kMaxLogSize;
   
-  int maxPartSize = NEXTPOWEROFTWO(std::max(minPartSize, (int)VEPCONV_IN0(VEPConvolution::idx_maxPartSize)));
+  int maxPartSize = std::max(minPartSize, (int)VEPCONV_IN0(VEPConvolution::idx_maxPartSize));
 
   unit->m_minPartSize = minPartSize;
   unit->m_maxPartSize = maxPartSize;
@@ -173,6 +281,19 @@ void VEPConvolution_Ctor(VEPConvolution *unit)
   unit->m_bufnum = -1e9f;
   unit->m_buftrig = 0.f;
   unit->m_conv = 0;
+  unit->m_batch = 0;
+  unit->m_kernelLoader = (VEPConvolution::KernelLoader*)RTAlloc(unit->mWorld, sizeof(VEPConvolution::KernelLoader));
+  if (unit->m_kernelLoader) {
+    memset(unit->m_kernelLoader, 0, sizeof(VEPConvolution::KernelLoader));
+    unit->m_kernelLoader->unit = unit;
+    unit->m_kernelLoader->cmd.unit = unit;
+    unit->m_kernelLoader->cmd.type = VEPConvolution::Cmd::kSetKernel;
+    unit->m_kernelLoader->cmd.data.SetKernel.loader = unit->m_kernelLoader;
+    unit->m_kernelLoader->loadedBufnum = -1;
+  }
+  unit->m_numShed = 0;
+  unit->m_numDropped = 0;
+  unit->m_reportHoldOff = 0;
   
 #if VEP_BENCHMARK
   unit->m_bench.init(690);
@@ -182,10 +303,17 @@ void VEPConvolution_Ctor(VEPConvolution *unit)
   //ClearUnitOutputs(unit, 1);
 
   VEPConvolution::Cmd* cmd = unit->allocCmd(VEPConvolution::Cmd::kInit);
+  cmd->data.Init.blockSize = BUFLENGTH;
+  cmd->data.Init.sampleRate = unit->mRate->mSampleRate;
   cmd->data.Init.numRTProcs =
     unit->mWorld->mRealTime
-      ? std::max(0, (int)VEPCONV_IN0(VEPConvolution::idx_numRTProcs))
+      ? (int)VEPCONV_IN0(VEPConvolution::idx_numRTProcs)
       : /* no threading in NRT */ 0;
+  cmd->data.Init.maxRTLoad = sc_clip(VEPCONV_IN0(VEPConvolution::idx_maxRTLoad), 0.05f, 1.f);
+  cmd->data.Init.overloadPolicy = sc_clip((int)VEPCONV_IN0(VEPConvolution::idx_overloadPolicy), 0, 2);
+  cmd->data.Init.kernelFormat = sc_clip((int)VEPCONV_IN0(VEPConvolution::idx_kernelFormat), 0, 2);
+  cmd->data.Init.batchId = std::max(0, (int)VEPCONV_IN0(VEPConvolution::idx_batch));
+  cmd->data.Init.tailCutoff = std::max(0, (int)(VEPCONV_IN0(VEPConvolution::idx_tailCutoff) * unit->mRate->mSampleRate));
   unit->doCmd(cmd);
   
   //    Print("<<< VEPConvolution_Ctor\n");
@@ -193,10 +321,24 @@ void VEPConvolution_Ctor(VEPConvolution *unit)
 
 void VEPConvolution_Dtor(VEPConvolution *unit)
 {
+  if (unit->m_kernelLoader != 0) {
+    // an in-flight load frees the loader in its cleanup stage
+    if (unit->m_kernelLoader->inFlight) {
+      unit->m_kernelLoader->unit = 0;
+    } else {
+      RTFree(unit->mWorld, unit->m_kernelLoader);
+    }
+    unit->m_kernelLoader = 0;
+  }
   if (unit->m_conv != 0) {
     VEPConvolution::Cmd* cmd = unit->allocCmd(VEPConvolution::Cmd::kRelease);
+    if (unit->m_batch) {
+      unit->m_batch->remove(unit->m_conv);
+    }
     cmd->data.Release.conv = unit->m_conv;
+    cmd->data.Release.batch = unit->m_batch;
     unit->m_conv = 0;
+    unit->m_batch = 0;
     unit->doCmd(cmd);
   }
 }
@@ -208,11 +350,12 @@ void VEPConvolution_next(VEPConvolution *unit, int inNumSamples)
   float bufnum = VEPCONV_IN0(VEPConvolution::idx_kernel);
   float buftrig = VEPCONV_IN0(VEPConvolution::idx_kernelTrigger);
 
-  if ((bufnum != unit->m_bufnum) || ((unit->m_buftrig <= 0.f) && (buftrig > 0.f))) {
+  const bool trig = (unit->m_buftrig <= 0.f) && (buftrig > 0.f);
+  if ((bufnum != unit->m_bufnum) || trig) {
     unit->m_bufnum = bufnum;
     int kernelOffset = (int)VEPCONV_IN0(VEPConvolution::idx_kernelOffset);
     int kernelSize = (int)VEPCONV_IN0(VEPConvolution::idx_kernelSize);
-    unit->setKernel((int)bufnum, kernelOffset, kernelSize, true);
+    unit->requestKernel((int)bufnum, kernelOffset, kernelSize, trig);
   }
   unit->m_buftrig = buftrig;
   
@@ -224,6 +367,7 @@ void VEPConvolution_next(VEPConvolution *unit, int inNumSamples)
     }
 #endif // !NDEBUG
     unit->process((size_t)inNumSamples);
+    unit->reportOverload((size_t)inNumSamples);
   } else {
     ClearUnitOutputs(unit, inNumSamples);
   }
@@ -231,6 +375,10 @@ void VEPConvolution_next(VEPConvolution *unit, int inNumSamples)
 #if VEP_BENCHMARK
   unit->m_bench.inc();
   unit->m_bench.printSummary(stdout, "conv");
+  if (unit->m_conv && unit->m_bench.atBoundary()) {
+    fprintf(stdout, "BENCH wake %.6f %.6f\n", unit->m_conv->wakeLatency(), unit->m_conv->maxWakeLatency());
+    unit->m_conv->printPerfStats(stdout);
+  }
 #endif // VEP_BENCHMARK
 
   //    Print("<<< VEPConvolution_next\n");
@@ -259,57 +407,164 @@ void VEPConvolution::doCmd(Cmd* cmd)
                         0, 0);
 }
 
-bool VEPConvolution::setKernel(int bufnum, int offset, int length, bool defer)
+void VEPConvolution::requestKernel(int bufnum, int offset, int length, bool reload)
 {
-  if (m_conv != 0) {
-    // do the football
-    SndBuf* buf = World_GetBuf(mWorld, bufnum);
-    if (buf->data == 0) {
-      Print("VEPConvolution: invalid buffer %d\n", bufnum);
-      return false;
-    }
-    // if (buf->channels < unit->m_numChannels) {
-    //   Print("VEPConvolution: channel count mismatch for buffer %d\n", data.bufnum);
-    //   return false;
-    // }
-    // TODO: implement offset and size
-    m_conv->setKernel(buf->data, buf->channels, buf->frames);
-  } else if (defer) {
-    // defer
-    Cmd* cmd = allocCmd(Cmd::kSetKernel);
-    Cmd::SetKernelData& data = cmd->data.SetKernel;
-    data.bufnum = bufnum;
-    data.offset = offset;
-    data.length = length;
-    doCmd(cmd);
-    return true;
+  KernelLoader* loader = m_kernelLoader;
+  if (loader == 0) return;
+  // a reload stays requested until it is loaded
+  reload = reload || (loader->pending && loader->request.reload);
+  loader->request.bufnum = bufnum;
+  loader->request.offset = offset;
+  loader->request.length = length;
+  loader->request.reload = reload;
+  loader->pending = true;
+  VEP::atomicStore(loader->generation, loader->generation + 1);
+  loadKernel();
+}
+
+void VEPConvolution::loadKernel()
+{
+  // the convolution is created by the init command; loads are started
+  // one at a time, so requests arriving meanwhile are coalesced
+  KernelLoader* loader = m_kernelLoader;
+  if ((loader == 0) || (m_conv == 0) || loader->inFlight || !loader->pending) return;
+  const KernelRequest request = loader->request;
+  loader->pending = false;
+  // skip requests that returned to the loaded kernel; the kernel is
+  // shared by all members of a batch, so it's only loaded if it's a
+  // different buffer or the trigger fired
+  const int loadedBufnum = m_batch ? m_batch->bufnum() : loader->loadedBufnum;
+  if (!request.reload && (request.bufnum == loadedBufnum)) return;
+  loader->loading = request;
+  loader->loadingGeneration = loader->generation;
+  loader->conv = m_conv;
+  loader->cmd.data.SetKernel.staged = 0;
+  loader->cmd.data.SetKernel.superseded = false;
+  loader->inFlight = true;
+  doCmd(&loader->cmd);
+}
+
+void VEPConvolution::setKernel(int bufnum, bool reload, VEP::Convolution::StagedKernel* staged)
+{
+  // another member of the batch may have loaded the kernel meanwhile
+  if (m_batch && !reload && (m_batch->bufnum() == bufnum)) {
+    return;
+  }
+  m_conv->swapKernel(staged);
+  if (m_batch) m_batch->setBufnum(bufnum);
+  if (m_conv->kernelError() > 0.) {
+    Print("VEPConvolution: kernel spectrum error %.1f dB\n", 20. * log10(m_conv->kernelError()));
+  }
+  if (m_conv->numSparsePartitions() > 0) {
+    Print("VEPConvolution: %d of %d partitions sparse (%d taps)\n",
+          (int)m_conv->numSparsePartitions(), (int)m_conv->response().numPartitions(), (int)m_conv->numTaps());
+  }
+  if (m_conv->tapError() > 0.) {
+    Print("VEPConvolution: sparse partition error %.1f dB\n", 20. * log10(m_conv->tapError()));
+  }
+  if (m_conv->hasTail()) {
+    Print("VEPConvolution: tail decay %.2f s (low) %.2f s (high)\n",
+          m_conv->tail(0)->decayLow(), m_conv->tail(0)->decayHigh());
   }
-  return false;
 }
 
 void VEPConvolution::process(size_t numSamples)
 {
+  if (m_batch) {
+    // the first member processed in this block computes for all
+    m_batch->process(mWorld->mBufCounter);
+  }
   m_conv->process(mOutBuf, const_cast<const float**>(mInBuf), m_numChannels, numSamples);
 }
 
+void VEPConvolution::reportOverload(size_t numSamples)
+{
+  // send /vep_overload numShed numDropped when partitions are faded or
+  // dropped, at most ten times per second
+  if (m_reportHoldOff > 0) {
+    m_reportHoldOff -= std::min(m_reportHoldOff, numSamples);
+    return;
+  }
+
+  const size_t numShed = m_conv->numShed();
+  const size_t numDropped = m_conv->numDropped();
+
+  if ((numShed != m_numShed) || (numDropped != m_numDropped)) {
+    float values[2];
+    values[0] = (float)numShed;
+    values[1] = (float)numDropped;
+    SendNodeReply(&mParent->mNode, -1, "/vep_overload", 2, values);
+    m_numShed = numShed;
+    m_numDropped = numDropped;
+    m_reportHoldOff = (size_t)(mRate->mSampleRate * 0.1);
+  }
+}
+
 bool VEPConvolution::cmdStage2(World* inWorld, Cmd* cmd) // NRT
 {
   switch (cmd->type) {
     case Cmd::kInit: {
       VEPConvolution* unit = cmd->unit;
-      VEP::Response* response = new VEP::Response(unit->m_numChannels, unit->m_kernelMaxSize, unit->m_minPartSize, unit->m_maxPartSize);
+      size_t responseSize = unit->m_kernelMaxSize;
+      if ((cmd->data.Init.tailCutoff > 0) && (cmd->data.Init.batchId > 0)) {
+        Print("VEPConvolution: tailCutoff is ignored in batches\n");
+      }
+      if ((cmd->data.Init.tailCutoff > 0) && (cmd->data.Init.batchId == 0)) {
+        // partitions after the cutoff are rendered by the tail
+        responseSize = std::min(responseSize,
+                                VEP::Convolution::tailResponseSize(cmd->data.Init.tailCutoff, cmd->data.Init.sampleRate));
+      }
+      VEP::Response response(unit->m_numChannels, responseSize, unit->m_minPartSize, unit->m_maxPartSize);
+      VEP::Convolution::Options options;
+      options.numRTProcs = cmd->data.Init.numRTProcs;
+      options.maxRTLoad = cmd->data.Init.maxRTLoad;
+      options.overloadPolicy = cmd->data.Init.overloadPolicy;
+      options.kernelFormat = (VEP::KernelFormat)cmd->data.Init.kernelFormat;
+      options.tailCutoff = cmd->data.Init.tailCutoff;
+      if (cmd->data.Init.batchId > 0) {
+        options.batch = cmd->data.Init.batch =
+          VEP::Batch::acquire(cmd->data.Init.batchId, response, cmd->data.Init.blockSize, options.kernelFormat);
+      }
       cmd->data.Init.conv = new VEP::Convolution(
-        VEP::Response(unit->m_numChannels, unit->m_kernelMaxSize, unit->m_minPartSize, unit->m_maxPartSize),
-        cmd->data.Init.numRTProcs);
+        response,
+        cmd->data.Init.blockSize,
+        cmd->data.Init.sampleRate,
+        options);
       cmd->data.Init.conv->response().printOn(stdout);
+      if (cmd->data.Init.conv->latency() > 0) {
+        Print("VEPConvolution: re-blocking latency %d\n", (int)cmd->data.Init.conv->latency());
+      }
     }
     return true;
-    case Cmd::kSetKernel:
-    // NOP
+    case Cmd::kSetKernel: {
+      KernelLoader* loader = cmd->data.SetKernel.loader;
+      // skip loads superseded before the transform starts
+      if (VEP::atomicLoad(loader->generation) != loader->loadingGeneration) {
+        cmd->data.SetKernel.superseded = true;
+        return true;
+      }
+      // do the football
+      const int bufnum = loader->loading.bufnum;
+      SndBuf* buf = World_GetNRTBuf(inWorld, bufnum);
+      if ((buf == 0) || (buf->data == 0)) {
+        Print("VEPConvolution: invalid buffer %d\n", bufnum);
+        return true;
+      }
+      // if (buf->channels < unit->m_numChannels) {
+      //   Print("VEPConvolution: channel count mismatch for buffer %d\n", data.bufnum);
+      //   return false;
+      // }
+      // TODO: implement offset and size
+      cmd->data.SetKernel.staged = loader->conv->stageKernel(buf->data, buf->channels, buf->frames);
+    }
     return true;
     case Cmd::kRelease: {
       delete cmd->data.Release.conv;
       cmd->data.Release.conv = 0;
+      if (cmd->data.Release.batch) {
+        cmd->data.Release.batch->release();
+        cmd->data.Release.batch = 0;
+      }
     }
     return true;
   }
@@ -321,12 +576,26 @@ bool VEPConvolution::cmdStage3(World* world, Cmd* cmd) // RT
 {
   switch (cmd->type) {
     case Cmd::kInit: {
-      cmd->unit->m_conv = cmd->data.Init.conv;
+      VEPConvolution* unit = cmd->unit;
+      unit->m_conv = cmd->data.Init.conv;
+      unit->m_batch = cmd->data.Init.batch;
+      if (unit->m_batch) {
+        // align partition boundaries with the other members
+        unit->m_conv->setPhase((size_t)world->mBufCounter * cmd->data.Init.blockSize);
+        unit->m_batch->add(unit->m_conv);
+      }
+      unit->loadKernel();
     }
     return true;
     case Cmd::kSetKernel: {
-      Cmd::SetKernelData& data = cmd->data.SetKernel;
-      return cmd->unit->setKernel(data.bufnum, data.offset, data.length, false);
+      // swap in the transformed kernel; the previous one is released in
+      // the next stage
+      KernelLoader* loader = cmd->data.SetKernel.loader;
+      VEPConvolution* unit = loader->unit;
+      if ((unit == 0) || (cmd->data.SetKernel.staged == 0)) return true;
+      unit->setKernel(loader->loading.bufnum, loader->loading.reload, cmd->data.SetKernel.staged);
+      loader->loadedBufnum = loader->loading.bufnum;
+      return true;
     }
   }
   return true;
@@ -334,18 +603,318 @@ bool VEPConvolution::cmdStage3(World* world, Cmd* cmd) // RT
 
 bool VEPConvolution::cmdStage4(World* world, Cmd* cmd) // NRT
 {
+  if ((cmd->type == Cmd::kSetKernel) && (cmd->data.SetKernel.staged != 0)) {
+    VEP::Convolution::releaseKernel(cmd->data.SetKernel.staged);
+    cmd->data.SetKernel.staged = 0;
+  }
   return true;
 }
 
-void VEPConvolution::cmdCleanup(World* world, void* cmd)
+void VEPConvolution::cmdCleanup(World* world, void* data)
+{
+  Cmd* cmd = (Cmd*)data;
+  if (cmd->type == Cmd::kSetKernel) {
+    // start the latest request, if any
+    KernelLoader* loader = cmd->data.SetKernel.loader;
+    loader->inFlight = false;
+    // a skipped reload stays requested
+    if (cmd->data.SetKernel.superseded && loader->loading.reload) {
+      loader->request.reload = true;
+    }
+    if (loader->unit == 0) {
+      RTFree(world, loader);
+    } else {
+      loader->unit->loadKernel();
+    }
+  } else {
+    RTFree(world, cmd);
+  }
+}
+
+// =====================================================================
+// VEPBinauralDecoder
+
+#define VEPDEC_IN0(i)   (unit->mInBuf[(i) + unit->m_numSpeakers][0])
+
+void VEPBinauralDecoder_Ctor(VEPBinauralDecoder *unit)
 {
+  unit->m_numSpeakers = unit->mNumInputs - VEPBinauralDecoder::kNumFixedInputs;
+  unit->m_decoder = 0;
+  unit->m_initCmd = 0;
+
+  SETCALC(VEPBinauralDecoder_next);
+  ClearUnitOutputs(unit, 1);
+
+  if (unit->mNumOutputs != 2) {
+    Print("VEPBinauralDecoder: needs two outputs\n");
+    return;
+  }
+
+  const int kernelBufnum = (int)VEPDEC_IN0(VEPBinauralDecoder::idx_kernel);
+  const int layoutBufnum = (int)VEPDEC_IN0(VEPBinauralDecoder::idx_layout);
+  SndBuf* kernel = World_GetBuf(unit->mWorld, kernelBufnum);
+  SndBuf* layout = World_GetBuf(unit->mWorld, layoutBufnum);
+  if (!kernel || !kernel->data || (kernel->channels != (int)(2 * unit->m_numSpeakers))) {
+    Print("VEPBinauralDecoder: HRIR buffer needs %d channels\n", (int)(2 * unit->m_numSpeakers));
+    return;
+  }
+  if (!layout || !layout->data || (layout->samples < (int)(2 * unit->m_numSpeakers))) {
+    Print("VEPBinauralDecoder: layout buffer needs %d values\n", (int)(2 * unit->m_numSpeakers));
+    return;
+  }
+
+  // see VEPConvolution_Ctor
+  int minPartSize = (int)VEPDEC_IN0(VEPBinauralDecoder::idx_minPartSize);
+  minPartSize = (int)VEP::FFT::nextValidSize(std::max(16, minPartSize > 0 ? minPartSize : BUFLENGTH));
+  if (minPartSize == 0) minPartSize = 1 << VEP::FFT::kMaxLogSize;
+
+  VEPBinauralDecoder::Cmd* cmd = unit->allocCmd(false);
+  if (cmd == 0) return;
+  cmd->kernelBufnum = kernelBufnum;
+  cmd->layoutBufnum = layoutBufnum;
+  cmd->numSpeakers = unit->m_numSpeakers;
+  cmd->blockSize = BUFLENGTH;
+  cmd->sampleRate = unit->mRate->mSampleRate;
+  cmd->minPartSize = minPartSize;
+  cmd->maxPartSize = std::max(minPartSize, (int)VEPDEC_IN0(VEPBinauralDecoder::idx_maxPartSize));
+  cmd->numRTProcs =
+    unit->mWorld->mRealTime
+      ? (int)VEPDEC_IN0(VEPBinauralDecoder::idx_numRTProcs)
+      : /* no threading in NRT */ 0;
+  unit->m_initCmd = cmd;
+  unit->doCmd(cmd);
+}
+
+void VEPBinauralDecoder_Dtor(VEPBinauralDecoder *unit)
+{
+  if (unit->m_initCmd != 0) {
+    // the init command deletes the decoder when it finds the unit gone
+    unit->m_initCmd->unit = 0;
+    unit->m_initCmd = 0;
+  }
+  if (unit->m_decoder != 0) {
+    VEPBinauralDecoder::Cmd* cmd = unit->allocCmd(true);
+    if (cmd == 0) return;
+    cmd->decoder = unit->m_decoder;
+    unit->m_decoder = 0;
+    unit->doCmd(cmd);
+  }
+}
+
+void VEPBinauralDecoder_next(VEPBinauralDecoder *unit, int inNumSamples)
+{
+  if (unit->m_decoder) {
+    unit->m_decoder->process(unit->mOutBuf, const_cast<const float**>(unit->mInBuf), unit->m_numSpeakers, (size_t)inNumSamples);
+  } else {
+    ClearUnitOutputs(unit, inNumSamples);
+  }
+}
+
+VEPBinauralDecoder::Cmd* VEPBinauralDecoder::allocCmd(bool release)
+{
+  Cmd* cmd = (Cmd*)RTAlloc(mWorld, sizeof(Cmd));
+  if (cmd == 0) return 0;
+  memset(cmd, 0, sizeof(Cmd));
+  cmd->unit = this;
+  cmd->release = release;
+  return cmd;
+}
+
+void VEPBinauralDecoder::doCmd(Cmd* cmd)
+{
+  DoAsynchronousCommand(mWorld, 0, "", (void*)cmd,
+                        (AsyncStageFn)cmdStage2,
+                        (AsyncStageFn)cmdStage3,
+                        (AsyncStageFn)cmdStage4,
+                        cmdCleanup,
+                        0, 0);
+}
+
+bool VEPBinauralDecoder::cmdStage2(World* world, Cmd* cmd) // NRT
+{
+  if (cmd->release) {
+    delete cmd->decoder;
+    cmd->decoder = 0;
+    return false;
+  }
+
+  // the buffers may have changed since the unit checked them
+  const size_t numSpeakers = cmd->numSpeakers;
+  SndBuf* kernel = (cmd->kernelBufnum >= 0) && (cmd->kernelBufnum < (int)world->mNumSndBufs)
+                   ? World_GetNRTBuf(world, cmd->kernelBufnum) : 0;
+  SndBuf* layoutBuf = (cmd->layoutBufnum >= 0) && (cmd->layoutBufnum < (int)world->mNumSndBufs)
+                      ? World_GetNRTBuf(world, cmd->layoutBufnum) : 0;
+  if (!kernel || !kernel->data || (kernel->frames <= 0) || (kernel->channels != (int)(2 * numSpeakers))) {
+    Print("VEPBinauralDecoder: HRIR buffer needs %d channels\n", (int)(2 * numSpeakers));
+    return false;
+  }
+  if (!layoutBuf || !layoutBuf->data || (layoutBuf->samples < (int)(2 * numSpeakers))) {
+    Print("VEPBinauralDecoder: layout buffer needs %d values\n", (int)(2 * numSpeakers));
+    return false;
+  }
+
+  std::vector<VEP::BinauralDecoder::Speaker> layout(numSpeakers);
+  for (size_t i=0; i < numSpeakers; ++i) {
+    layout[i].azimuth = layoutBuf->data[2*i];
+    layout[i].elevation = layoutBuf->data[2*i+1];
+  }
+
+  VEP::Convolution::Options options;
+  options.numRTProcs = cmd->numRTProcs;
+  cmd->decoder = new VEP::BinauralDecoder(
+    layout,
+    kernel->data, kernel->frames,
+    cmd->minPartSize, cmd->maxPartSize,
+    cmd->blockSize, cmd->sampleRate,
+    options);
+
+  Print("VEPBinauralDecoder: %d speakers, %d symmetric pairs, %d convolutions\n",
+        (int)numSpeakers, (int)cmd->decoder->numPairs(), (int)cmd->decoder->numConvolutions());
+  return true;
+}
+
+bool VEPBinauralDecoder::cmdStage3(World* world, Cmd* cmd) // RT
+{
+  // if the unit is gone, the decoder is deleted in the next stage
+  if (cmd->unit != 0) {
+    cmd->unit->m_decoder = cmd->decoder;
+    cmd->unit->m_initCmd = 0;
+    cmd->decoder = 0;
+  }
+  return true;
+}
+
+bool VEPBinauralDecoder::cmdStage4(World* world, Cmd* cmd) // NRT
+{
+  delete cmd->decoder;
+  cmd->decoder = 0;
+  return true;
+}
+
+void VEPBinauralDecoder::cmdCleanup(World* world, void* data)
+{
+  Cmd* cmd = (Cmd*)data;
+  // a failed init doesn't reach the RT stage
+  if (!cmd->release && (cmd->unit != 0)) {
+    cmd->unit->m_initCmd = 0;
+  }
   RTFree(world, cmd);
 }
 
+// =====================================================================
+// vepAudit plugin command
+//
+// /cmd vepAudit <numChannels> <numFrames> <minPartSize> <maxPartSize>
+//               <numRTProcs> <overloadPolicy>: check that every module
+// of a convolution with these parameters is aligned to its IR offset
+// at the server block size.
+
+struct VEPAuditCmd
+{
+  int numChannels;
+  int numFrames;
+  int minPartSize;
+  int maxPartSize;
+  int numRTProcs;
+  int overloadPolicy;
+};
+
+static bool VEPAudit_stage2(World* world, void* data) // NRT
+{
+  VEPAuditCmd* cmd = (VEPAuditCmd*)data;
+  if ((cmd->numChannels < 1) || (cmd->numFrames < 1)) {
+    Print("vepAudit: invalid response size\n");
+    return false;
+  }
+  VEP::Response response(cmd->numChannels, cmd->numFrames, cmd->minPartSize, cmd->maxPartSize);
+  VEP::Convolution::Options options;
+  options.numRTProcs = cmd->numRTProcs;
+  options.overloadPolicy = cmd->overloadPolicy;
+  if (VEP::Convolution::audit(response, world->mBufLength, world->mSampleRate, options, stdout)) {
+    Print("vepAudit: PASSED\n");
+  } else {
+    Print("vepAudit: FAILED: convolution modules are misaligned\n");
+  }
+  return true;
+}
+
+static void VEPAudit_cleanup(World* world, void* data) // RT
+{
+  RTFree(world, data);
+}
+
+static void VEPAudit_cmd(World* world, void* userData, struct sc_msg_iter* args, void* replyAddr)
+{
+  VEPAuditCmd* cmd = (VEPAuditCmd*)RTAlloc(world, sizeof(VEPAuditCmd));
+  if (cmd == 0) return;
+  cmd->numChannels = args->geti(2);
+  cmd->numFrames = args->geti(world->mSampleRate);
+  int minPartSize = args->geti(0);
+  minPartSize = (int)VEP::FFT::nextValidSize(std::max(16, minPartSize > 0 ? minPartSize : world->mBufLength));
+  if (minPartSize == 0) minPartSize = 1 << VEP::FFT::kMaxLogSize;
+  cmd->minPartSize = minPartSize;
+  cmd->maxPartSize = std::max(minPartSize, args->geti(8192));
+  cmd->numRTProcs = args->geti(0);
+  cmd->overloadPolicy = args->geti(VEP::Convolution::kOverloadWait);
+  DoAsynchronousCommand(world, replyAddr, "vepAudit", (void*)cmd,
+                        VEPAudit_stage2, 0, 0,
+                        VEPAudit_cleanup,
+                        0, 0);
+}
+
+#if VEP_TRACE
+// =====================================================================
+// vepTrace plugin command
+//
+// /cmd vepTrace <path>: write the convolution trace as Chrome trace
+// event JSON to path (default vep_trace.json).
+
+struct VEPTraceCmd
+{
+  char path[PATH_MAX];
+};
+
+static bool VEPTrace_stage2(World* world, void* data) // NRT
+{
+  VEPTraceCmd* cmd = (VEPTraceCmd*)data;
+  FILE* file = fopen(cmd->path, "w");
+  if (file == 0) {
+    Print("vepTrace: couldn't open %s\n", cmd->path);
+    return false;
+  }
+  VEP::Trace::dump(file);
+  fclose(file);
+  Print("vepTrace: wrote %s\n", cmd->path);
+  return true;
+}
+
+static void VEPTrace_cleanup(World* world, void* data) // RT
+{
+  RTFree(world, data);
+}
+
+static void VEPTrace_cmd(World* world, void* userData, struct sc_msg_iter* args, void* replyAddr)
+{
+  VEPTraceCmd* cmd = (VEPTraceCmd*)RTAlloc(world, sizeof(VEPTraceCmd));
+  if (cmd == 0) return;
+  strncpy(cmd->path, args->gets("vep_trace.json"), PATH_MAX - 1);
+  cmd->path[PATH_MAX - 1] = '\0';
+  DoAsynchronousCommand(world, replyAddr, "vepTrace", (void*)cmd,
+                        VEPTrace_stage2, 0, 0,
+                        VEPTrace_cleanup,
+                        0, 0);
+}
+#endif // VEP_TRACE
+
 void load(InterfaceTable *it)
 {
   ft = it;
   DefineDtorCantAliasUnit(VEPConvolution);
+  DefineDtorCantAliasUnit(VEPBinauralDecoder);
+  DefinePlugInCmd("vepAudit", VEPAudit_cmd, 0);
+#if VEP_TRACE
+  DefinePlugInCmd("vepTrace", VEPTrace_cmd, 0);
+#endif // VEP_TRACE
 }
 
 // EOF
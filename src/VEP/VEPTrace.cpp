@@ -0,0 +1,153 @@
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#include "VEPTrace.h"
+
+#if VEP_TRACE
+
+#include "VEP.h"
+
+using namespace VEP;
+
+namespace
+{
+  enum
+  {
+    kMaxThreads = 16,
+    kNumEvents  = 1 << 16   // per thread, oldest events are overwritten
+  };
+
+  struct Event
+  {
+    double      time;
+    const char* name;
+    int         arg;
+    char        phase;
+  };
+
+  enum State
+  {
+    kUnused,
+    kActive,
+    kReleased   // events kept until the buffer is claimed again
+  };
+
+  struct EventBuffer
+  {
+    volatile int    state;
+    const char*     name;
+    volatile size_t count;
+    Event           events[kNumEvents];
+  };
+
+  EventBuffer       gBuffers[kMaxThreads];
+  volatile int      gOutOfBuffers = 0;
+  __thread EventBuffer* tBuffer = 0;
+  __thread bool     tNoBuffer = false;
+
+  // claim an unused buffer or, failing that, the one of a thread that
+  // has exited
+  EventBuffer* claimBuffer()
+  {
+    static const int kClaimable[] = { kUnused, kReleased };
+    for (size_t k=0; k < sizeof(kClaimable)/sizeof(kClaimable[0]); ++k) {
+      for (int i=0; i < kMaxThreads; ++i) {
+        EventBuffer* buffer = gBuffers + i;
+        if (__sync_bool_compare_and_swap(&buffer->state, kClaimable[k], (int)kActive)) {
+          buffer->name = 0;
+          atomicStore(buffer->count, (size_t)0);
+          return buffer;
+        }
+      }
+    }
+    if (__sync_bool_compare_and_swap(&gOutOfBuffers, 0, 1)) {
+      fprintf(stdout, "VEP::Trace: all %d buffers in use, new threads are not traced\n", (int)kMaxThreads);
+    }
+    return 0;
+  }
+
+  inline EventBuffer* threadBuffer()
+  {
+    if ((tBuffer == 0) && !tNoBuffer) {
+      tBuffer = claimBuffer();
+      tNoBuffer = tBuffer == 0;
+    }
+    return tBuffer;
+  }
+};
+
+void VEP::Trace::event(Phase phase, const char* name, int arg)
+{
+  EventBuffer* buffer = threadBuffer();
+  if (buffer == 0) return;
+  
+  const size_t count = buffer->count;
+  Event& e = buffer->events[count % kNumEvents];
+  e.time = Timer::time();
+  e.name = name;
+  e.arg = arg;
+  e.phase = (char)phase;
+  atomicStore(buffer->count, count + 1);
+}
+
+void VEP::Trace::setThreadName(const char* name)
+{
+  EventBuffer* buffer = threadBuffer();
+  if (buffer != 0) buffer->name = name;
+}
+
+void VEP::Trace::releaseThread()
+{
+  if (tBuffer != 0) {
+    atomicStore(tBuffer->state, (int)kReleased);
+    tBuffer = 0;
+  }
+  tNoBuffer = true;
+}
+
+void VEP::Trace::dump(FILE* stream)
+{
+  // NOTE: threads keep recording while dumping, the oldest events of a
+  // busy thread may be overwritten before they are written out
+  const char* sep = "";
+  
+  fprintf(stream, "{\"traceEvents\":[\n");
+  for (int i=0; i < kMaxThreads; ++i) {
+    const EventBuffer& buffer = gBuffers[i];
+    if (atomicLoad(buffer.state) == kUnused) continue;
+    const size_t count = atomicLoad(buffer.count);
+    const size_t first = count > kNumEvents ? count - kNumEvents : 0;
+
+    fprintf(stream, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            sep, i, buffer.name ? buffer.name : "unknown");
+    sep = ",\n";
+    
+    for (size_t k=first; k < count; ++k) {
+      const Event& e = buffer.events[k % kNumEvents];
+      fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d%s,\"args\":{\"arg\":%d}}",
+              sep, e.name, e.phase, e.time * 1e6, i,
+              e.phase == kInstant ? ",\"s\":\"t\"" : "", e.arg);
+    }
+  }
+  fprintf(stream, "\n]}\n");
+}
+
+#endif // VEP_TRACE
+
+// EOF
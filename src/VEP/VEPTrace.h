@@ -0,0 +1,92 @@
+// -*- c++ -*-
+//
+// VEP binaural rendering engine
+//
+// Copyright (C) 2005-2006 Stefan Kersten <sk@k-hornz.de>
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+// USA
+
+#ifndef VEP_TRACE_H_INCLUDED
+#define VEP_TRACE_H_INCLUDED
+
+#include <stdio.h>
+
+// =====================================================================
+// VEP::Trace
+//
+// Timeline tracing (SCons option TRACE). Every thread records events
+// into its own fixed size ring buffer without locks or allocation; the
+// buffers are written to Chrome trace event JSON on request, which can
+// be viewed in Perfetto or chrome://tracing.
+
+#if VEP_TRACE
+
+namespace VEP
+{
+  namespace Trace
+  {
+    enum Phase
+    {
+      kBegin    = 'B',
+      kEnd      = 'E',
+      kInstant  = 'i'
+    };
+    
+    // record an event in the calling thread's buffer; name must be a
+    // string literal
+    void event(Phase phase, const char* name, int arg=0);
+    // name the calling thread
+    void setThreadName(const char* name);
+    // hand the calling thread's buffer over to the next new thread;
+    // its events are kept until then
+    void releaseThread();
+    // write all buffers to stream as Chrome trace JSON
+    void dump(FILE* stream);
+
+    // scoped begin/end pair
+    class Scope
+    {
+    public:
+      Scope(const char* name, int arg=0)
+        : m_name(name)
+      {
+        event(kBegin, name, arg);
+      }
+      ~Scope()
+      {
+        event(kEnd, m_name);
+      }
+    private:
+      const char* m_name;
+    };
+  };
+};
+
+# define VEP_TRACE_SCOPE(name, arg)   VEP::Trace::Scope vepTraceScope_(name, arg)
+# define VEP_TRACE_INSTANT(name, arg) VEP::Trace::event(VEP::Trace::kInstant, name, arg)
+# define VEP_TRACE_THREAD(name)       VEP::Trace::setThreadName(name)
+# define VEP_TRACE_THREAD_EXIT()      VEP::Trace::releaseThread()
+
+#else // !VEP_TRACE
+
+# define VEP_TRACE_SCOPE(name, arg)
+# define VEP_TRACE_INSTANT(name, arg)
+# define VEP_TRACE_THREAD(name)
+# define VEP_TRACE_THREAD_EXIT()
+
+#endif // VEP_TRACE
+
+#endif // VEP_TRACE_H_INCLUDED